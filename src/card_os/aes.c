@@ -266,16 +266,22 @@ aes_init (uint8_t * key, uint8_t keysize, uint8_t * ta)
 }
 
 /***************************************************
- generic  call
+ context call - SBOX, inverse SBOX and expanded key are calculated once
+ for more blocks
 */
-void __attribute__ ((weak))
-aes_run (uint8_t * buf, uint8_t * key, uint8_t keysize, uint8_t mode)
+void
+aes_init_ctx (struct aes_ctx *ctx, uint8_t * key, uint8_t keysize)
+{
+  ctx->rounds = aes_init (key, keysize, ctx->ta);
+}
+
+void
+aes_run_ctx (struct aes_ctx *ctx, uint8_t * buf, uint8_t mode)
 {
-  uint8_t ta[2400];
-  uint8_t rounds;
+  uint8_t *ta = ctx->ta;
+  uint8_t rounds = ctx->rounds;
   uint8_t *kkey = KEY;
 
-  rounds = aes_init (key, keysize, ta);
   if (mode)
     {
       // decrypt
@@ -318,3 +324,15 @@ aes_run (uint8_t * buf, uint8_t * key, uint8_t keysize, uint8_t mode)
       addEKey (buf, kkey);
     }
 }
+
+/***************************************************
+ generic  call
+*/
+void __attribute__ ((weak))
+aes_run (uint8_t * buf, uint8_t * key, uint8_t keysize, uint8_t mode)
+{
+  struct aes_ctx ctx;
+
+  aes_init_ctx (&ctx, key, keysize);
+  aes_run_ctx (&ctx, buf, mode);
+}
@@ -26,3 +26,14 @@ expanded in RAM, SBOX and INV SBOX is calculated in RAM.
 */
 
 void aes_run (uint8_t * data, uint8_t * key, uint8_t keysize, uint8_t mode);
+
+// context for more blocks with same key (C code only)
+// ta: expanded key (max 240 bytes), SBOX, inverse SBOX
+struct aes_ctx
+{
+  uint8_t ta[256 + 256 + 256];
+  uint8_t rounds;
+};
+
+void aes_init_ctx (struct aes_ctx *ctx, uint8_t * key, uint8_t keysize);
+void aes_run_ctx (struct aes_ctx *ctx, uint8_t * data, uint8_t mode);
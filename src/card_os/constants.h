@@ -165,6 +165,13 @@
                           0xd5, 0xcd, 0x24, 0x6b, 0xed, 0x11, 0x10, 0x63,\
                           0x78, 0xda, 0xc8, 0xff, 0x95, 0x2b, 0x19, 0x07
 
+// Barrett constant for reduction modulo order (ECDSA), mu = 2^(2k)/(order << shift) - 2^k,
+// k = 8 * arithmetic length, order is shifted to k bits, leading zero bytes are not stored
+#define N_P192V1_mu	C_P192V1+7
+#define S_P192V1_mu	12
+#define C_P192V1_mu       0xcf, 0xd7, 0x2d, 0x4b, 0x4e, 0x36, 0x94, 0xeb,\
+                          0xc9, 0x07, 0x21, 0x66
+
 // pack all curve parameters
 #define CUR_P192V1	\
                         N_P192V1_prime,    S_P192V1_prime,    C_P192V1_prime,\
@@ -172,9 +179,79 @@
                         N_P192V1_a,        S_P192V1_a,        C_P192V1_a,\
                         N_P192V1_b,        S_P192V1_b,        C_P192V1_b,\
                         N_P192V1_Gx,       S_P192V1_Gx,       C_P192V1_Gx,\
-                        N_P192V1_Gy,       S_P192V1_Gy,       C_P192V1_Gy,
+                        N_P192V1_Gy,       S_P192V1_Gy,       C_P192V1_Gy,\
+                        N_P192V1_mu,       S_P192V1_mu,       C_P192V1_mu,
  
 
+/////////////////////////////////////////////////////////////////////////////////////////////
+// curve ID (needed in ec.h/ec.c to determine fast reduction algo,
+// then curve parameters incremented by 1... (prime,order,a,b,Gx,Gy)
+#define C_SECP224R1       0x38
+
+#define N_SECP224R1_prime	C_SECP224R1+1
+#define S_SECP224R1_prime	28
+#define C_SECP224R1_prime 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
+                          0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff
+
+#define N_SECP224R1_order	C_SECP224R1+2
+#define S_SECP224R1_order	28
+#define C_SECP224R1_order 0x3d, 0x2a, 0x5c, 0x5c, 0x45, 0x29, 0xdd, 0x13,\
+                          0x3e, 0xf0, 0xb8, 0xe0, 0xa2, 0x16, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff
+
+#define N_SECP224R1_a	C_SECP224R1+3
+#define S_SECP224R1_a	28
+#define C_SECP224R1_a     0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff
+
+#define N_SECP224R1_b	C_SECP224R1+4
+#define S_SECP224R1_b	28
+#define C_SECP224R1_b     0xb4, 0xff, 0x55, 0x23, 0x43, 0x39, 0x0b, 0x27,\
+                          0xba, 0xd8, 0xbf, 0xd7, 0xb7, 0xb0, 0x44, 0x50,\
+                          0x56, 0x32, 0x41, 0xf5, 0xab, 0xb3, 0x04, 0x0c,\
+                          0x85, 0x0a, 0x05, 0xb4
+
+#define N_SECP224R1_Gx	C_SECP224R1+5
+#define S_SECP224R1_Gx	28
+#define C_SECP224R1_Gx    0x21, 0x1d, 0x5c, 0x11, 0xd6, 0x80, 0x32, 0x34,\
+                          0x22, 0x11, 0xc2, 0x56, 0xd3, 0xc1, 0x03, 0x4a,\
+                          0xb9, 0x90, 0x13, 0x32, 0x7f, 0xbf, 0xb4, 0x6b,\
+                          0xbd, 0x0c, 0x0e, 0xb7
+
+#define N_SECP224R1_Gy	C_SECP224R1+6
+#define S_SECP224R1_Gy	28
+#define C_SECP224R1_Gy    0x34, 0x7e, 0x00, 0x85, 0x99, 0x81, 0xd5, 0x44,\
+                          0x64, 0x47, 0x07, 0x5a, 0xa0, 0x75, 0x43, 0xcd,\
+                          0xe6, 0xdf, 0x22, 0x4c, 0xfb, 0x23, 0xf7, 0xb5,\
+                          0x88, 0x63, 0x37, 0xbd
+
+// Barrett constant for reduction modulo order
+#define N_SECP224R1_mu	C_SECP224R1+7
+#define S_SECP224R1_mu	18
+#define C_SECP224R1_mu    0xcf, 0xa4, 0xba, 0xd4, 0xc3, 0xd5, 0xa3, 0xa3,\
+                          0xba, 0xd6, 0x22, 0xec, 0xc1, 0x0f, 0x47, 0x1f,\
+                          0x5d, 0xe9
+
+#if MP_BYTES >= 32
+// pack all curve parameters
+#define CUR_SECP224R1	\
+                        N_SECP224R1_prime, S_SECP224R1_prime, C_SECP224R1_prime,\
+                        N_SECP224R1_order, S_SECP224R1_order, C_SECP224R1_order,\
+                        N_SECP224R1_a,     S_SECP224R1_a,     C_SECP224R1_a,\
+                        N_SECP224R1_b,     S_SECP224R1_b,     C_SECP224R1_b,\
+                        N_SECP224R1_Gx,    S_SECP224R1_Gx,    C_SECP224R1_Gx,\
+                        N_SECP224R1_Gy,    S_SECP224R1_Gy,    C_SECP224R1_Gy,\
+                        N_SECP224R1_mu,    S_SECP224R1_mu,    C_SECP224R1_mu,
+#else
+#define CUR_SECP224R1
+#endif
+
+
 /////////////////////////////////////////////////////////////////////////////////////////////
 // curve ID (needed in ec.h/ec.c to determine fast reduction algo,
 // then curve parameters incremented by 1... (prime,order,a,b,Gx,Gy)
@@ -221,6 +298,14 @@
                           0xce, 0x5e, 0x31, 0x6b, 0x57, 0x33, 0xce, 0x2b,\
                           0x16, 0x9e, 0x0f, 0x7c, 0x4a, 0xeb, 0xe7, 0x8e,\
                           0x9b, 0x7f, 0x1a, 0xfe, 0xe2, 0x42, 0xe3, 0x4f
+// Barrett constant for reduction modulo order
+#define N_P256V1_mu	C_P256V1+7
+#define S_P256V1_mu	28
+#define C_P256V1_mu       0xfe, 0x9b, 0xdf, 0xee, 0x85, 0xfd, 0x2f, 0x01,\
+                          0x21, 0x6c, 0x1a, 0xdf, 0x52, 0x05, 0x19, 0x43,\
+                          0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xff,\
+                          0xff, 0xff, 0xff, 0xff
+
 #if MP_BYTES >= 32
 // pack all curve parameters
 #define CUR_P256V1	\
@@ -229,7 +314,8 @@
                         N_P256V1_a,        S_P256V1_a,        C_P256V1_a,\
                         N_P256V1_b,        S_P256V1_b,        C_P256V1_b,\
                         N_P256V1_Gx,       S_P256V1_Gx,       C_P256V1_Gx,\
-                        N_P256V1_Gy,       S_P256V1_Gy,       C_P256V1_Gy,
+                        N_P256V1_Gy,       S_P256V1_Gy,       C_P256V1_Gy,\
+                        N_P256V1_mu,       S_P256V1_mu,       C_P256V1_mu,
 #else
 #define CUR_P256V1
 #endif
@@ -293,6 +379,13 @@
                           0x7c, 0x14, 0x9a, 0x28, 0xbd, 0x1d, 0xf4, 0xf8,\
                           0x29, 0xdc, 0x92, 0x92, 0xbf, 0x98, 0x9e, 0x5d,\
                           0x6f, 0x2c, 0x26, 0x96, 0x4a, 0xde, 0x17, 0x36
+// Barrett constant for reduction modulo order
+#define N_SECP384R1_mu	C_SECP384R1+7
+#define S_SECP384R1_mu	24
+#define C_SECP384R1_mu    0x8d, 0xd6, 0x3a, 0x33, 0x95, 0xe6, 0x13, 0x13,\
+                          0x85, 0x58, 0x4f, 0xb7, 0x4d, 0xf2, 0xe5, 0xa7,\
+                          0x20, 0xd2, 0xc8, 0x0b, 0x7e, 0xb2, 0x9c, 0x38
+
 #if MP_BYTES >= 48
 // pack all curve parameters
 #define CUR_SECP384R1	\
@@ -301,7 +394,8 @@
                         N_SECP384R1_a,        S_SECP384R1_a,        C_SECP384R1_a,\
                         N_SECP384R1_b,        S_SECP384R1_b,        C_SECP384R1_b,\
                         N_SECP384R1_Gx,       S_SECP384R1_Gx,       C_SECP384R1_Gx,\
-                        N_SECP384R1_Gy,       S_SECP384R1_Gy,       C_SECP384R1_Gy,
+                        N_SECP384R1_Gy,       S_SECP384R1_Gy,       C_SECP384R1_Gy,\
+                        N_SECP384R1_mu,       S_SECP384R1_mu,       C_SECP384R1_mu,
 #else
 #define CUR_SECP384R1
 #endif
@@ -421,6 +515,15 @@
                         0x36, 0xf1, 0x29, 0x96, 0x5c, 0x78, 0x81, 0x7f,\
                         0xeb, 0x01
 */
+// Barrett constant for reduction modulo order
+#define N_SECP521R1_mu	C_SECP521R1+7
+#define S_SECP521R1_mu	40
+#define C_SECP521R1_mu    0x9a, 0xa3, 0x91, 0x03, 0xea, 0x11, 0x88, 0xfb,\
+                          0xcd, 0x63, 0xb7, 0x70, 0x24, 0x48, 0xa2, 0x28,\
+                          0xdc, 0x31, 0xbb, 0x23, 0x1b, 0x25, 0xe2, 0x17,\
+                          0x2d, 0x7b, 0x84, 0x5b, 0xff, 0x19, 0x40, 0xca,\
+                          0x34, 0x68, 0x20, 0x3e, 0xbc, 0x3c, 0xd7, 0x02
+
 #if MP_BYTES >= 66
 // pack all curve parameters
 #define CUR_SECP521R1	\
@@ -429,7 +532,8 @@
                         N_SECP521R1_a,        S_SECP521R1_a,        C_SECP521R1_a,\
                         N_SECP521R1_b,        S_SECP521R1_b,        C_SECP521R1_b,\
                         N_SECP521R1_Gx,       S_SECP521R1_Gx,       C_SECP521R1_Gx,\
-                        N_SECP521R1_Gy,       S_SECP521R1_Gy,       C_SECP521R1_Gy,
+                        N_SECP521R1_Gy,       S_SECP521R1_Gy,       C_SECP521R1_Gy,\
+                        N_SECP521R1_mu,       S_SECP521R1_mu,       C_SECP521R1_mu,
 #else
 #define CUR_SECP521R1
 #endif
@@ -479,6 +583,66 @@
                                 0xa8, 0x08, 0x11, 0x0e, 0xfc, 0xfb, 0xa4, 0x5d,\
                                 0x65, 0xc4, 0xa3, 0x26, 0x77, 0xda, 0x3a, 0x48
 
+// Barrett constant for reduction modulo order
+#define N_SECP256K1_mu	C_SECP256K1+7
+#define S_SECP256K1_mu	17
+#define C_SECP256K1_mu    0xc0, 0xbe, 0xc9, 0x2f, 0x73, 0xa1, 0x2d, 0x40,\
+                          0xc4, 0x5f, 0xb7, 0x50, 0x19, 0x23, 0x51, 0x45,\
+                          0x01
+
+// GLV endomorphism, (beta * x, y) = lambda * (x, y)
+#define N_SECP256K1_beta	0x50
+#define S_SECP256K1_beta	32
+#define C_SECP256K1_beta	0xee, 0x01, 0x95, 0x71, 0x28, 0x6c, 0x39, 0xc1,\
+                                0x95, 0x89, 0xf5, 0x12, 0x75, 0x49, 0xf0, 0x9c,\
+                                0xe9, 0x34, 0x34, 0xac, 0x9e, 0x47, 0x64, 0x6e,\
+                                0x10, 0x07, 0x7c, 0x65, 0x2b, 0x6a, 0xe9, 0x7a
+
+#define N_SECP256K1_lambda	0x51
+#define S_SECP256K1_lambda	32
+#define C_SECP256K1_lambda	0x72, 0xbd, 0x23, 0x1b, 0x7c, 0x96, 0x02, 0xdf,\
+                                0x78, 0x66, 0x81, 0x20, 0xea, 0x22, 0x2e, 0x12,\
+                                0x5a, 0x64, 0x12, 0x88, 0x02, 0x1c, 0x26, 0xa5,\
+                                0xe0, 0x30, 0x5c, 0xc0, 0x4c, 0xad, 0x63, 0x53
+
+// scalar decomposition, lattice (a1, b1), (a2, b2): a1 = b2, -b1
+// g1 = round (2^384 * b2 / order), g2 = round (2^384 * -b1 / order)
+#define N_SECP256K1_g1		0x52
+#define S_SECP256K1_g1		32
+#define C_SECP256K1_g1		0x31, 0xb0, 0xdb, 0x45, 0x9a, 0x20, 0x93, 0xe8,\
+                                0x7f, 0xca, 0xe8, 0x71, 0x14, 0x8a, 0xaa, 0x3d,\
+                                0x15, 0xeb, 0x84, 0x92, 0xe4, 0x90, 0x6c, 0xe8,\
+                                0xcd, 0x6b, 0xd4, 0xa7, 0x21, 0xd2, 0x86, 0x30
+
+#define N_SECP256K1_g2		0x53
+#define S_SECP256K1_g2		32
+#define C_SECP256K1_g2		0x71, 0x7f, 0xc4, 0x8a, 0xae, 0xb4, 0x71, 0x15,\
+                                0xc6, 0x06, 0xf5, 0x9d, 0xac, 0x08, 0x12, 0x22,\
+                                0xc4, 0xe4, 0xbf, 0x0a, 0xa9, 0x7f, 0x54, 0x6f,\
+                                0x28, 0x88, 0x0e, 0x01, 0xd6, 0x7e, 0x43, 0xe4
+
+#define N_SECP256K1_b2		0x54
+#define S_SECP256K1_b2		16
+#define C_SECP256K1_b2		0x15, 0xeb, 0x84, 0x92, 0xe4, 0x90, 0x6c, 0xe8,\
+                                0xcd, 0x6b, 0xd4, 0xa7, 0x21, 0xd2, 0x86, 0x30
+
+#define N_SECP256K1_mb1		0x55
+#define S_SECP256K1_mb1		16
+#define C_SECP256K1_mb1		0xc3, 0xe4, 0xbf, 0x0a, 0xa9, 0x7f, 0x54, 0x6f,\
+                                0x28, 0x88, 0x0e, 0x01, 0xd6, 0x7e, 0x43, 0xe4
+
+#ifdef EC_GLV
+#define CUR_SECP256K1_GLV \
+                        N_SECP256K1_beta,  S_SECP256K1_beta,  C_SECP256K1_beta,\
+                        N_SECP256K1_lambda,S_SECP256K1_lambda,C_SECP256K1_lambda,\
+                        N_SECP256K1_g1,    S_SECP256K1_g1,    C_SECP256K1_g1,\
+                        N_SECP256K1_g2,    S_SECP256K1_g2,    C_SECP256K1_g2,\
+                        N_SECP256K1_b2,    S_SECP256K1_b2,    C_SECP256K1_b2,\
+                        N_SECP256K1_mb1,   S_SECP256K1_mb1,   C_SECP256K1_mb1,
+#else
+#define CUR_SECP256K1_GLV
+#endif
+
 #if defined(NIST_ONLY) || MP_BYTES <32
 #define CUR_SECP256K1
 #else
@@ -488,7 +652,9 @@
                         N_SECP256K1_a,     S_SECP256K1_a,     C_SECP256K1_a,\
                         N_SECP256K1_b,     S_SECP256K1_b,     C_SECP256K1_b,\
                         N_SECP256K1_Gx,    S_SECP256K1_Gx,    C_SECP256K1_Gx,\
-                        N_SECP256K1_Gy,    S_SECP256K1_Gy,    C_SECP256K1_Gy,
+                        N_SECP256K1_Gy,    S_SECP256K1_Gy,    C_SECP256K1_Gy,\
+                        N_SECP256K1_mu,    S_SECP256K1_mu,    C_SECP256K1_mu,\
+                        CUR_SECP256K1_GLV
 #endif
 
 #if 1
@@ -507,6 +673,7 @@
   CUR_SECP521R1\
   CUR_SECP384R1\
   CUR_P256V1\
+  CUR_SECP224R1\
   CUR_P192V1\
   CUR_SECP256K1\
   DIGEST_PREFIXES\
@@ -60,6 +60,10 @@
 #define DEBUG_V 128
 #endif
 
+#ifdef DEBUG_TLV
+#define DEBUG_V 512
+#endif
+
 #ifdef DEBUG_BN_MATH
 #define DEBUG_V 8192
 #endif
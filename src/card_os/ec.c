@@ -27,6 +27,7 @@
     tested curves (with fast reduction algo):
 
     secp192r1/nistp192/prime192v1
+    secp224r1/nistp224
     secp256r1/nistp256/prime256v1
     secp384r1
     secp521r1
@@ -65,6 +66,11 @@
 #define  EC_MUL_WINDOW 4
 #endif
 
+// GLV multiplication is available for secp256k1 only
+#if defined (NIST_ONLY) || MP_BYTES < 32
+#undef EC_GLV
+#endif
+
 
 uint8_t
 mp_get_len (void)
@@ -251,15 +257,86 @@ field_sub (bignum_t * r, bignum_t * a)
   sub_mod (r, a, field_prime);
 }
 
+/*
+multiplication modulo curve order (ECDSA), Barrett reduction
+
+k = 8 * mp_get_len(), order is normalized to k bits: N = order << shift
+(shift is 0 for all curves except P-224 and P-521, there shift = 32/55,
+whole bytes are shifted by memmove), constant mu = 2^(2k)/N - 2^k is read
+from constants (curve ID + 7)
+
+x = (a * b) << shift      (x mod N = (x mod order) << shift)
+q = x_H + (x_H * mu)_H    (q <= x/N, max error 3)
+r = x - q * N             (only k+64 bits are calculated)
+r = r - N                 3 times, result selected by borrow, no branch
+c = r >> shift
+
+if constant is not available, generic (bit serial) reduction is used
+*/
 static void
 mul_mod (bignum_t * c, bignum_t * a, bignum_t * b, bignum_t * mod)
 {
+  uint8_t len = mp_get_len ();
+  uint8_t i, shift, idx;
+  bigbignum_t t;
+  bignum_t mu;
+  uint8_t n[MP_BYTES + 8];
+  uint8_t *r[2];
+
   DPRINT ("%s\n", __FUNCTION__);
 
   mp_mul (&bn_tmp, a, b);
-  mp_mod (&bn_tmp, mod);
+
+  memset (&mu, 0, sizeof (bignum_t));
+  if (!get_constant (&mu, (curve_type & 0x3f) + 7))
+    {
+      mp_mod (&bn_tmp, mod);
+      memset (c, 0, MP_BYTES);
+      memcpy (c, &bn_tmp, len);
+      return;
+    }
+// normalize order and x
+  memset (n, 0, sizeof (n));
+  mp_set (n, mod);
+  for (shift = 0; !n[len - 1]; shift += 8)
+    {
+      memmove (n + 1, n, len - 1);
+      n[0] = 0;
+    }
+  for (; !(n[len - 1] & 0x80); shift++)
+    mp_shiftl ((bignum_t *) n);
+
+// whole bytes of shift by memmove (secp224r1: 32 bits, secp521r1: 55 bits)
+  idx = shift / 8;
+  memmove (bn_tmp.value + idx, bn_tmp.value, 2 * len - idx);
+  memset (bn_tmp.value, 0, idx);
+  mp_set_len (2 * len);
+  for (i = 0; i < (shift & 7); i++)
+    mp_shiftl ((bignum_t *) & bn_tmp);
+  mp_set_len (len);
+
+// q = x_H + (x_H * mu)_H, q is below 2^k, carry is always 0
+  mp_mul (&t, (bignum_t *) & bn_tmp.value[len], &mu);
+  mp_add ((bignum_t *) & t.value[len], (bignum_t *) & bn_tmp.value[len]);
+  memcpy (&mu, &t.value[len], len);
+  mp_mul (&t, &mu, (bignum_t *) n);
+
+// r = x - q * N (r < 4N, fits in k+64 bits)
+  mp_set_len (len + 8);
+  mp_sub ((bignum_t *) & bn_tmp, (bignum_t *) & bn_tmp, (bignum_t *) & t);
+  r[0] = bn_tmp.value;
+  r[1] = t.value;
+  idx = 0;
+  for (i = 0; i < 3; i++)
+    idx ^= 1 ^ mp_sub ((bignum_t *) r[idx ^ 1], (bignum_t *) r[idx],
+		       (bignum_t *) n);
+  mp_set_len (len);
+
+  for (i = 0; i < (shift & 7); i++)
+    mp_shiftr ((bignum_t *) r[idx]);
+
   memset (c, 0, MP_BYTES);
-  memcpy (c, &bn_tmp, mp_get_len ());
+  memcpy (c, r[idx] + shift / 8, len - shift / 8);
 }
 
 
@@ -647,6 +724,69 @@ fast256reduction (bignum_t * result, bigbignum_t * bn)
   field_add (result, (bignum_t *) ptr_l);
 }
 #endif
+#if MP_BYTES >= 32
+/*
+ FAST REDUCTION for nistp224/secp224r1 OID 1.3.132.0.33 curve
+
+ result = bn (mod P224), arithmetic length is 32 bytes
+
+ P224 = 26959946667150639794667015087019630673557916260026308143510066298881
+ P224 = 0xFFFFFFFF FFFFFFFF FFFFFFFF FFFFFFFF 00000000 00000000 00000001
+ (2^224-2^96+1)
+
+ (Ai in 32 bit quantities, A14 = A15 = 0)
+ T  = ( A6  || A5  || A4  || A3  || A2  || A1  || A0  )
+ S1 = ( A10 || A9  || A8  || A7  || 0   || 0   || 0   )
+ S2 = ( 0   || A13 || A12 || A11 || 0   || 0   || 0   )
+ D1 = ( A13 || A12 || A11 || A10 || A9  || A8  || A7  )
+ D2 = ( 0   || 0   || 0   || 0   || A13 || A12 || A11 )
+ R = T + S1 + S2 - D1 - D2
+
+ here slightly changed calculation is used:
+ R = (2*P224) + S1 + S2 - D1 - D2 + T
+ R is positive and below 2^227, bits over 224 (h) are reduced by
+ 2^224 = 2^96 - 1 (mod P224):  R = R_L + (h << 96) - h
+ R_L + (h << 96) - h is below 2*P224, final field_add() reduces it.
+
+ not static, AVR field_reduction() (lib/avr/ec_fast_red.S) jumps here if
+ EC_SECP224R1_ASM is not defined
+*/
+void
+fast224reduction (bignum_t * result, bigbignum_t * bn)
+{
+  uint8_t *ptr = (void *) bn;
+  uint8_t *r = (void *) result;
+
+// 2x p224.. (to eliminate borrow in -D1 -D2)
+  memset (r, 0, 32);
+  r[0] = 2;
+  r[3 * 4] = 0xfe;
+  memset (r + 3 * 4 + 1, 0xff, 15);
+  r[7 * 4] = 1;
+  // S1 (A10 || A9 || A8 || A7), S2 (A14 || A13 || A12 || A11)
+  mp_set_len (16);
+  r[7 * 4] += mp_add ((bignum_t *) (r + 3 * 4), (bignum_t *) (ptr + 7 * 4));
+  r[7 * 4] += mp_add ((bignum_t *) (r + 3 * 4), (bignum_t *) (ptr + 11 * 4));
+  mp_set_len (32);
+  // D1
+  mp_sub (result, result, (bignum_t *) (ptr + 7 * 4));
+  // D2 - copy A13 || A12 || A11 over A9 || A8 || A7
+  memcpy (ptr + 7 * 4, ptr + 11 * 4, 3 * 4);
+  memset (ptr + 10 * 4, 0, 5 * 4);
+  mp_sub (result, result, (bignum_t *) (ptr + 7 * 4));
+  // T
+  memset (ptr + 7 * 4, 0, 4);
+  mp_add (result, (bignum_t *) bn);
+
+  // (h << 96) - h  in bn, clear h in result
+  memset (ptr, 0, 64);
+  ptr[3 * 4] = r[7 * 4];
+  ptr[8 * 4] = r[7 * 4];
+  r[7 * 4] = 0;
+  mp_sub ((bignum_t *) ptr, (bignum_t *) ptr, (bignum_t *) (ptr + 8 * 4));
+  field_add (result, (bignum_t *) bn);
+}
+#endif
 /*
  FAST REDUCTION for nistp192/prime192v1/secp192r1 OID 1.2.840.10045.3.1.1 curve
 
@@ -714,6 +854,10 @@ void __attribute__((weak)) field_reduction (bignum_t * r, bigbignum_t * bn)
   if (curve_type == (C_P256V1 | C_P256V1_MASK))
     return fast256reduction (r, bn);
 #endif
+#if MP_BYTES >= 32
+  if (curve_type == (C_SECP224R1 | C_SECP224R1_MASK))
+    return fast224reduction (r, bn);
+#endif
 #if MP_BYTES >= 32
   if (curve_type == (C_SECP256K1 | C_SECP256K1_MASK))
     return secp256k1reduction (r, bn);
@@ -961,8 +1105,100 @@ ec_full_add (ec_point_t * result, ec_point_t * s, ec_point_t * t)
   ec_add (result, t);
 }
 
+#if defined (EC_GLV) || defined (EC_MUL_SIGNED)
+// negate point if neg == 1 (result selected by index, no branch)
+static void
+ec_neg (ec_point_t * p, uint8_t neg)
+{
+  bignum_t y[2];
 
-#if EC_MUL_WINDOW == 2
+  memcpy (&y[0], &p->Y, sizeof (bignum_t));
+  memset (&y[1], 0, sizeof (bignum_t));
+  field_sub (&y[1], &p->Y);
+  memcpy (&p->Y, &y[neg], sizeof (bignum_t));
+}
+#endif
+
+#if defined (EC_MUL_SIGNED)
+#if EC_MUL_WINDOW != 4 && EC_MUL_WINDOW != 5
+#error EC_MUL_SIGNED needs EC_MUL_WINDOW 4 or 5
+#endif
+/*
+regular signed window (Joye, Tunstall), k must be odd (see ec_odd_key)
+
+w = EC_MUL_WINDOW, n_i = bits w*i .. w*i + w - 1 of k
+d_i = (n_i | 1) - 2^w, if bit w*(i+1) of k is 0
+d_i = (n_i | 1)      , if bit w*(i+1) of k is 1
+d_top = n_top | 1
+
+all digits are odd, |d_i| < 2^w, there is no zero digit, every window
+is one doubling chain and one real addition.  Only odd multiples of point
+are precomputed: table[i] = (2 * i + 1) * P, for negative digit the point
+from table is negated (ec_neg).
+*/
+// bits pos .. pos + w - 1 of k
+static uint8_t
+ec_get_bits (uint8_t * k, uint16_t pos, uint8_t w)
+{
+  uint16_t t;
+
+  t = k[pos / 8] | (uint16_t) k[pos / 8 + 1] << 8;
+  return (t >> (pos & 7)) & ((1 << w) - 1);
+}
+
+static void
+ec_mul (ec_point_t * point, uint8_t * k)
+{
+  int16_t i;
+  uint8_t b, j, neg;
+
+  DPRINT ("%s\n", __FUNCTION__);
+
+  ec_point_t data[(1 << (EC_MUL_WINDOW - 1)) + 2];
+
+  ec_point_t *r = &data[0];	// r[0] result, r[1] selected point
+  ec_point_t *table = &data[2];	// table[i] = (2 * i + 1) * point
+
+  memcpy (&table[0], point, sizeof (ec_point_t));
+  memcpy (&r[1], point, sizeof (ec_point_t));
+  ec_double (&r[1]);
+  for (j = 1; j < (1 << (EC_MUL_WINDOW - 1)); j++)
+    ec_full_add (&table[j], &table[j - 1], &r[1]);
+
+  i = mp_get_len () + EC_BLIND;
+#if MP_BYTES >= 66
+  if (curve_type == (C_SECP521R1 | C_SECP521R1_MASK))
+    i = 66 + EC_BLIND;
+#endif
+#if MP_BYTES >= 32
+  if (curve_type == (C_SECP224R1 | C_SECP224R1_MASK))
+    i = 28 + EC_BLIND;
+#endif
+#if EC_BLIND == 0
+  // key + order (ec_odd_key) can be longer than order
+  i++;
+#endif
+  // index of top digit
+  i = (i * 8 + EC_MUL_WINDOW - 1) / EC_MUL_WINDOW - 1;
+
+  b = ec_get_bits (k, i * EC_MUL_WINDOW, EC_MUL_WINDOW);
+  memcpy (&r[0], &table[b >> 1], sizeof (ec_point_t));
+  while (i--)
+    {
+      for (j = 0; j < EC_MUL_WINDOW; j++)
+	ec_double (&r[0]);
+      b = ec_get_bits (k, i * EC_MUL_WINDOW, EC_MUL_WINDOW + 1);
+      neg = ((b >> EC_MUL_WINDOW) & 1) ^ 1;
+      b = (b | 1) & ((1 << EC_MUL_WINDOW) - 1);
+      // |d_i| = neg ? 2^w - b : b
+      b ^= (b ^ ((1 << EC_MUL_WINDOW) - b)) & (-neg);
+      memcpy (&r[1], &table[b >> 1], sizeof (ec_point_t));
+      ec_neg (&r[1], neg);
+      ec_add (&r[0], &r[1]);
+    }
+  memcpy (point, &r[0], sizeof (ec_point_t));
+}
+#elif EC_MUL_WINDOW == 2
 // constant time - do ec_add into false result for zero bit(s) in k
 static void
 ec_mul (ec_point_t * point, uint8_t * k)
@@ -988,6 +1224,10 @@ ec_mul (ec_point_t * point, uint8_t * k)
 #if MP_BYTES >= 66
   if (curve_type == (C_SECP521R1 | C_SECP521R1_MASK))
     i = 66 + EC_BLIND - 1;
+#endif
+#if MP_BYTES >= 32
+  if (curve_type == (C_SECP224R1 | C_SECP224R1_MASK))
+    i = 28 + EC_BLIND - 1;
 #endif
   for (; i >= 0; i--)
     {
@@ -1103,6 +1343,10 @@ ec_mul (ec_point_t * point, uint8_t * k)
 #if MP_BYTES >= 66
   if (curve_type == (C_SECP521R1 | C_SECP521R1_MASK))
     i = 66 + EC_BLIND - 1;
+#endif
+#if MP_BYTES >= 32
+  if (curve_type == (C_SECP224R1 | C_SECP224R1_MASK))
+    i = 28 + EC_BLIND - 1;
 #endif
   for (; i >= 0; i--)
     {
@@ -1125,6 +1369,160 @@ ec_mul (ec_point_t * point, uint8_t * k)
 #error Unknown EC_MUL_WINDOW
 #endif
 
+#ifdef EC_GLV
+/*
+GLV multiplication for secp256k1
+
+endomorphism phi (X, Y, Z) = (beta * X, Y, Z) = lambda * (X, Y, Z)
+k = k1 + k2 * lambda mod order, |k1|, |k2| < 2^128:
+c1 = round (k * g1 / 2^384), c2 = round (k * g2 / 2^384)
+k2 = c1 * (-b1) - c2 * b2,  k1 = k - k2 * lambda
+
+blinding: random * (b2, b1) is added to (k1, k2), b2 + b1 * lambda = 0 mod
+order, random value is below 2^(8 * EC_BLIND - 2), b2 < 2^126, -b1 < 2^128
+
+k1, k2 are replaced by (order - k1), (order - k2) if this is smaller,
+points P, phi(P) are negated.  Joint table i * P + j * phi(P) (i, j = 0..3)
+is used, 2 doublings and one addition for 2 bits of k1 and k2.
+*/
+#define GLV_BYTES (16 + EC_BLIND)
+
+// c = round (k * constant / 2^384)
+static void
+ec_glv_round (bignum_t * c, bignum_t * k, uint8_t id)
+{
+  bigbignum_t t;
+  uint16_t carry;
+  uint8_t i;
+
+  memset (c, 0, sizeof (bignum_t));
+  get_constant (c, id);
+  mp_mul (&t, k, c);
+
+  memset (c, 0, sizeof (bignum_t));
+  carry = t.value[47] >> 7;
+  for (i = 0; i < 16; i++)
+    {
+      carry += t.value[48 + i];
+      c->value[i] = carry;
+      carry >>= 8;
+    }
+  c->value[16] = carry;
+}
+
+// k = min (k, order - k), return 1 if (order - k) is used
+static uint8_t
+ec_glv_abs (bignum_t * k, bignum_t * order)
+{
+  bignum_t t[2];
+  uint8_t neg;
+
+  memcpy (&t[0], k, sizeof (bignum_t));
+  memset (&t[1], 0, sizeof (bignum_t));
+  mp_sub (&t[1], order, k);
+  neg = mp_sub (k, &t[1], &t[0]);
+  memcpy (k, &t[neg], sizeof (bignum_t));
+  return neg;
+}
+
+// return bit 0: k1 is negative, bit 1: k2 is negative
+static uint8_t
+ec_glv_split (bignum_t * k1, bignum_t * k2, bignum_t * k, bignum_t * order)
+{
+  bignum_t c, g;
+
+  ec_glv_round (&c, k, N_SECP256K1_g1);
+  memset (&g, 0, sizeof (bignum_t));
+  get_constant (&g, N_SECP256K1_mb1);
+  mul_mod (k2, &c, &g, order);
+
+  ec_glv_round (&c, k, N_SECP256K1_g2);
+  memset (&g, 0, sizeof (bignum_t));
+  get_constant (&g, N_SECP256K1_b2);
+  mul_mod (&c, &c, &g, order);
+  sub_mod (k2, &c, order);
+
+  memset (&g, 0, sizeof (bignum_t));
+  get_constant (&g, N_SECP256K1_lambda);
+  mul_mod (&c, k2, &g, order);
+  memcpy (k1, k, sizeof (bignum_t));
+  sub_mod (k1, &c, order);
+
+#if EC_BLIND > 0
+  memset (&c, 0, sizeof (bignum_t));
+  rnd_get (c.value, EC_BLIND);
+  c.value[EC_BLIND - 1] &= 0x3f;
+  c.value[EC_BLIND - 1] |= 0x20;
+
+  memset (&g, 0, sizeof (bignum_t));
+  get_constant (&g, N_SECP256K1_b2);
+  mul_mod (&g, &c, &g, order);
+  add_mod (k1, &g, order);
+
+  memset (&g, 0, sizeof (bignum_t));
+  get_constant (&g, N_SECP256K1_mb1);
+  mul_mod (&g, &c, &g, order);
+  sub_mod (k2, &g, order);
+#endif
+  return ec_glv_abs (k1, order) | (ec_glv_abs (k2, order) << 1);
+}
+
+static void
+ec_mul_glv (ec_point_t * point, bignum_t * k, bignum_t * order)
+{
+  int8_t i;
+  uint8_t b, b1, b2, j;
+  uint8_t index, neg;
+  bignum_t k1, k2, beta;
+
+  DPRINT ("%s\n", __FUNCTION__);
+
+  ec_point_t data[17];		// 0,1 used as result, 2..17 as precomputed table
+
+  ec_point_t *r = &data[0];
+  ec_point_t *table = &data[1];	// table[i + 4 * j] = i * P + j * phi(P)
+
+  neg = ec_glv_split (&k1, &k2, k, order);
+
+  memcpy (&table[1], point, sizeof (ec_point_t));
+  ec_neg (&table[1], neg & 1);
+  memcpy (&table[2], &table[1], sizeof (ec_point_t));
+  ec_double (&table[2]);
+  ec_full_add (&table[3], &table[2], &table[1]);
+
+  memset (&beta, 0, sizeof (bignum_t));
+  get_constant (&beta, N_SECP256K1_beta);
+  for (j = 4; j < 16; j += 4)
+    {
+      memcpy (&table[j], &table[j / 4], sizeof (ec_point_t));
+      field_mul (&table[j].X, &table[j].X, &beta);
+      // table[1..3] is already negated by sign of k1
+      ec_neg (&table[j], (neg ^ (neg >> 1)) & 1);
+      for (b = 1; b < 4; b++)
+	ec_full_add (&table[j + b], &table[j], &table[b]);
+    }
+
+  memcpy (&r[1], &table[2], sizeof (ec_point_t));
+  memset (&r[0], 0, sizeof (ec_point_t));
+  for (i = GLV_BYTES - 1; i >= 0; i--)
+    {
+      b1 = k1.value[i];
+      b2 = k2.value[i];
+      for (j = 0; j < 4; j++)
+	{
+	  ec_double (&r[0]);
+	  ec_double (&r[0]);
+	  b = (b1 >> 6) | ((b2 >> 4) & 0x0c);
+	  index = (b == 0);
+	  ec_add (&r[index], &table[b | index]);
+	  b1 <<= 2;
+	  b2 <<= 2;
+	}
+    }
+  memcpy (point, &r[0], sizeof (ec_point_t));
+}
+#endif
+
 /*
 a=2048 b=7  mask=80              b = a[i] & 255;
 a=1536 b=5  mask=20              b |= (b & 0xC0) >> 5;
@@ -1143,6 +1541,11 @@ ec_set_param (struct ec_param *ec)
 #if MP_BYTES >= 66
   if (ec->mp_size == 66)
     mp_set_len (72);
+#endif
+#if MP_BYTES >= 32
+  // secp224r1, 32 bytes arithmetic (28 bytes is not supported in ASM code)
+  if (ec->mp_size == 28)
+    mp_set_len (32);
 #endif
   field_prime = &ec->prime;
   param_a = &ec->a;
@@ -1174,6 +1577,26 @@ static void
 }
 #endif
 
+#ifdef EC_MUL_SIGNED
+// signed window recoding needs odd scalar, for even key add curve order
+// (order is odd), (key + order) * P = key * P
+static void
+  __attribute__((noinline)) ec_odd_key (uint8_t * key, bignum_t * order)
+{
+  uint8_t t[2][sizeof (bignum_t) + 8];
+  uint8_t len;
+
+  memset (t[1], 0, sizeof (t[1]));
+  memcpy (t[1], order, sizeof (bignum_t));
+  memcpy (t[0], key, sizeof (t[0]));
+  len = mp_get_len ();
+  mp_set_len (len + 8);
+  mp_add ((bignum_t *) t[1], (bignum_t *) key);
+  mp_set_len (len);
+  memcpy (key, t[(key[0] & 1) ^ 1], sizeof (t[0]));
+}
+#endif
+
 // point = k * point
 static uint8_t
 ec_calc_key (bignum_t * k, ec_point_t * point, struct ec_param *ec)
@@ -1195,11 +1618,19 @@ ec_calc_key (bignum_t * k, ec_point_t * point, struct ec_param *ec)
 #if EC_BLIND > 0
   ec_blind_key (blind_key, &(ec->order));
 #endif
+#ifdef EC_MUL_SIGNED
+  ec_odd_key (blind_key, &(ec->order));
+#endif
 
   DPRINT ("multiplication\n");
 
   ec_projectify (point);
-  ec_mul (point, blind_key);
+#ifdef EC_GLV
+  if (curve_type == (C_SECP256K1 | C_SECP256K1_MASK))
+    ec_mul_glv (point, k, &(ec->order));
+  else
+#endif
+    ec_mul (point, blind_key);
 
   if (ec_affinify (point, ec))
     return 1;
@@ -63,6 +63,7 @@ typedef struct
 // for A=-3 set bit 6
 
 #define C_P192V1_MASK    0x40
+#define C_SECP224R1_MASK 0x40
 #define C_P256V1_MASK    0x40
 #define C_SECP384R1_MASK 0x40
 #define C_SECP521R1_MASK 0x40
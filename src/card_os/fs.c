@@ -38,6 +38,7 @@ indent -linux -l100
 #include "iso7816.h"
 #include "fs.h"
 #include "key.h"
+#include "tlv.h"
 /*
 
 Limitation:
@@ -100,12 +101,39 @@ struct pin {
 
 // sec_device is description for one 256 byte block for storing pin/puks and other security info
 
+// change journal entry (file ID and change counter after file change)
+struct fs_journal {
+	uint16_t id;
+	uint16_t counter;
+} __attribute__((__packed__));
+
+#if SEC_MEM_SIZE < 1024
+#define FS_JOURNAL_SIZE 3
+#else
+#define FS_JOURNAL_SIZE 8
+#endif
+
+#ifdef RSA_PRIME_POOL
+// pregenerated RSA prime (size in bytes, other values - free slot)
+struct prime_pool_slot {
+	uint8_t size;
+	uint8_t prime[RSA_BYTES];
+} __attribute__((__packed__));
+#endif
+
 struct sec_device {
 	struct pin pins[14];
 	uint8_t lifecycle;	// 1 card in initialization state, 7 card is initialized
-	uint8_t reserved;
+	uint8_t tree;		// 0 - CREATE FILE TREE in progress, free space is not clean
+	struct fs_journal journal[FS_JOURNAL_SIZE];
+	uint8_t journal_pos;	// position of last journal entry
+#ifdef RSA_PRIME_POOL
+	struct prime_pool_slot pool[RSA_PRIME_POOL];
+#endif
 } __attribute__((__packed__));
 
+_Static_assert(sizeof(struct sec_device) <= SEC_MEM_SIZE, "sec_device does not fit in SEC_MEM_SIZE");
+
 struct fs_data {
 	uint16_t id;		// file id from tag 0x83
 	uint16_t size;		// from tag 0x80/0x81
@@ -128,6 +156,111 @@ struct fs_response {
 } __attribute__((__packed__));
 
 struct fs_response fci_sel __attribute__((section(".noinit")));
+
+/*
+Session objects
+
+EF (or key file) with session flag (bit 0 in 2nd byte of proprietary
+information, tag 0x85) is created in RAM, not in FLASH/EEPROM.  RAM is
+mapped into filesystem offsets FS_SESSION_BASE .. 0xffff, files in RAM are
+stored in same format as in FLASH (linear list of files, end of list is
+marked by ID 0xffff).  FLASH files can not use this offset range.
+fs_search_file() continues from the end of FLASH list to the list in RAM,
+all other functions access files by offset and they do not need to know
+where the file is.  RAM is cleared in fs_init() (card power up/reset),
+deleted session objects are removed immediately (RAM is compacted).
+*/
+#ifdef FS_SESSION_SIZE
+#if FS_SESSION_SIZE > 0x8000
+#error FS_SESSION_SIZE too big
+#endif
+#define FS_SESSION_BASE ((uint16_t)(0x10000UL - FS_SESSION_SIZE))
+#define FS_PROP_SESSION 0x0001
+
+static uint8_t fs_session[FS_SESSION_SIZE] __attribute__((section(".noinit")));
+
+// 0 = FLASH, 1 = RAM, 2 = block crosses FLASH/RAM boundary or end of RAM
+static uint8_t fs_session_block(uint16_t offset, uint8_t size)
+{
+	uint32_t end = (uint32_t) offset + (size ? size : 256);
+
+	if (offset < FS_SESSION_BASE)
+		return end > FS_SESSION_BASE ? 2 : 0;
+	return end > 0x10000UL ? 2 : 1;
+}
+
+static uint8_t fs_read_block(void *buffer, uint16_t offset, uint8_t size)
+{
+	uint8_t ret = fs_session_block(offset, size);
+
+	if (ret == 0)
+		return device_read_block(buffer, offset, size);
+	if (ret == 1)
+		memcpy(buffer, fs_session + (offset - FS_SESSION_BASE), size ? size : 256);
+	return ret - 1;
+}
+
+static uint8_t fs_write_block(void *buffer, uint16_t offset, uint8_t size)
+{
+	uint8_t ret = fs_session_block(offset, size);
+
+	if (ret == 0)
+		return device_write_block(buffer, offset, size);
+	if (ret == 1)
+		memcpy(fs_session + (offset - FS_SESSION_BASE), buffer, size ? size : 256);
+	return ret - 1;
+}
+
+static uint8_t fs_write_ff(uint16_t offset, uint8_t size)
+{
+	uint8_t ret = fs_session_block(offset, size);
+
+	if (ret == 0)
+		return device_write_ff(offset, size);
+	if (ret == 1)
+		memset(fs_session + (offset - FS_SESSION_BASE), 0xff, size ? size : 256);
+	return ret - 1;
+}
+#else
+// no RAM for session objects, all files in FLASH
+#define FS_SESSION_BASE 0xffff
+#define fs_read_block device_read_block
+#define fs_write_block device_write_block
+#define fs_write_ff device_write_ff
+#endif
+
+/*
+Bulk creation of file tree (personalization)
+
+The tree is created in the current DF (or in the parent DF if EF is
+selected).  Files are written sequentially behind the end of filesystem,
+the header of the first file is held in RAM and written in fs_tree_commit(),
+until then the whole tree is not visible to fs_search_file().  While the
+tree is in progress, flag in sec_device is set, if the card is reset,
+fs_init() erases data of already written files from free space.
+
+Data (one or more blocks, each block contains whole TLVs):
+ 62 L FCP	create file (same FCP as in CREATE FILE), DF becomes current DF
+ 53 L data	initial content of EF created by previous TLV (type 0x01 only)
+ 01 00		end of DF, parent DF becomes current DF
+*/
+
+static struct {
+	struct fs_data first;	// header of 1st file
+	uint16_t start;		// offset of 1st file
+	uint16_t end;		// offset of next file
+	uint16_t uuid;		// next free uuid
+	uint16_t root;		// uuid of DF where tree is created
+	uint16_t df;		// uuid of current DF
+	uint16_t data;		// data offset of last created EF (0 = no EF)
+	uint8_t root_acl;	// create ACL of root DF
+	uint8_t acl;		// create ACL of current DF
+	uint8_t depth;		// 0 = root DF is current DF
+	uint8_t active;
+} fs_tree __attribute__((section(".noinit")));
+
+static void fs_tree_clean(void);
+
 /*
 security_enable & 1 = pin 1 verified ..
 security_enable & 2 = pin 2 verified ..
@@ -144,6 +277,25 @@ security_enable & 0x8000 = admin state ON
 
 static uint16_t security_enable __attribute__((section(".noinit")));	//bit mapped security enabled levels (by pin 1..14)
 
+/*
+ACL cache - the access conditions of the selected file are evaluated
+only once (all four ACL nibbles, one lifecycle read), then each check is
+a single bit test.  The cache key is the ACL of the file, not the file
+itself, the result depends only on ACL, security_enable and lifecycle.
+Cache must be invalidated (acl_cache.valid = 0) on any change of
+security_enable or lifecycle.
+
+acl_cache.allowed bit 0 = acl[0] >> 4 (READ, CREATE EF)
+                  bit 1 = acl[0] & 0xf (UPDATE, CREATE DF)
+                  bit 2 = acl[1] >> 4 (DELETE)
+                  bit 3 = acl[1] & 0xf (GENERATE)
+*/
+static struct {
+	uint8_t acl[2];
+	uint8_t allowed;
+	uint8_t valid;
+} acl_cache __attribute__((section(".noinit")));
+
 /*
    0       - deauth all pins
    1...14  - deauth pin 1..14
@@ -168,6 +320,7 @@ void fs_deauth(uint8_t pin)
 		return;
 
 	security_enable &= sec;
+	acl_cache.valid = 0;
 }
 
 // mminimalize eeprom changes, normal lifecycle codes are 1 and 7,
@@ -182,6 +335,148 @@ static uint8_t get_lifecycle(void)
 	return lc ^ 0xfe;
 }
 
+/*
+Change journal
+
+Change counter (device_get_change_counter()) is incremented on each write
+into filesystem.  For last FS_JOURNAL_SIZE changed files, file ID and change
+counter after first change is stored in ring buffer in sec_device.  Repeated
+change of same file does not write into sec_device (EEPROM wear).  The last
+change of file is bounded by the counter of next (newer) entry, for the
+newest entry by actual change counter, fs_get_journal() reports these
+values.  Host can validate all cached files by one GET DATA command.
+Session objects are not journaled (RAM).  Card erase writes MF ID 0x3f00
+(whole cache is invalid).
+*/
+static void fs_journal_add(uint16_t id, uint16_t mem_offset)
+{
+	struct fs_journal j;
+	uint8_t pos;
+
+	if (mem_offset >= FS_SESSION_BASE)
+		return;
+
+	sec_device_read_block(&pos, offsetof(struct sec_device, journal_pos), 1);
+	if (pos >= FS_JOURNAL_SIZE)
+		pos = 0;
+	sec_device_read_block(&j, offsetof(struct sec_device, journal[pos]), sizeof(j));
+	if (j.id == id)
+		return;
+	if (++pos == FS_JOURNAL_SIZE)
+		pos = 0;
+	j.id = id;
+	j.counter = device_get_change_counter();
+	DPRINT("%s %04x counter %04x pos %d\n", __FUNCTION__, id, j.counter, pos);
+	// write entry first, then position (entry is visible even if position
+	// is not updated)
+	sec_device_write_block(&j, offsetof(struct sec_device, journal[pos]), sizeof(j));
+	sec_device_write_block(&pos, offsetof(struct sec_device, journal_pos), 1);
+}
+
+// response: change counter, then journal entries (ID, counter), newest first
+uint8_t fs_get_journal(struct iso7816_response *r)
+{
+	struct fs_journal j;
+	uint8_t pos, i;
+	uint8_t *data = r->data;
+	uint16_t counter = device_get_change_counter();
+
+	*data++ = counter >> 8;
+	*data++ = counter & 0xff;
+
+	sec_device_read_block(&pos, offsetof(struct sec_device, journal_pos), 1);
+	if (pos >= FS_JOURNAL_SIZE)
+		pos = 0;
+	// last change of newest entry is bounded by actual counter
+	for (i = 0; i < FS_JOURNAL_SIZE; i++) {
+		sec_device_read_block(&j, offsetof(struct sec_device, journal[pos]), sizeof(j));
+		// empty entry
+		if (j.id == 0xffff)
+			break;
+		*data++ = j.id >> 8;
+		*data++ = j.id & 0xff;
+		*data++ = counter >> 8;
+		*data++ = counter & 0xff;
+		// older entry, bounded by 1st change of this file
+		counter = j.counter;
+		pos = pos ? pos - 1 : FS_JOURNAL_SIZE - 1;
+	}
+	RESP_READY(data - r->data);
+}
+
+#ifdef RSA_PRIME_POOL
+/*
+RSA prime pool
+
+Primes are generated by proprietary APDU (GENERATE ASYMMETRIC KEY PAIR,
+P1=0x80) and stored in sec_device.  RSA key generation takes two primes of
+requested size from pool, slot is cleared immediately (prime is used only
+once).
+*/
+static uint8_t fs_prime_pool_size(uint8_t slot)
+{
+	uint8_t size;
+
+	sec_device_read_block(&size, offsetof(struct sec_device, pool[slot].size), 1);
+	if (size == 0 || size > RSA_BYTES)
+		return 0;
+	return size;
+}
+
+// fill sizes of primes in pool (0 = free slot) into "sizes"
+// return number of primes of size "size"
+uint8_t fs_prime_pool_status(uint8_t * sizes, uint8_t size)
+{
+	uint8_t i, count = 0;
+
+	for (i = 0; i < RSA_PRIME_POOL; i++) {
+		sizes[i] = fs_prime_pool_size(i);
+		if (sizes[i] == size)
+			count++;
+	}
+	return count;
+}
+
+uint8_t fs_prime_pool_put(uint8_t * prime, uint8_t size)
+{
+	uint8_t i;
+
+	for (i = 0; i < RSA_PRIME_POOL; i++) {
+		if (fs_prime_pool_size(i))
+			continue;
+		// write prime first, then size (slot is valid after size is written)
+		if (sec_device_write_block(prime, offsetof(struct sec_device, pool[i].prime), size))
+			return S0x6581;	//memory fail
+		if (sec_device_write_block(&size, offsetof(struct sec_device, pool[i].size), 1))
+			return S0x6581;	//memory fail
+		return S_RET_OK;
+	}
+	return S0x6a84;		//not enough memory space in the file
+}
+
+// get prime of "size" bytes from pool, return 0 if there is no such prime
+uint8_t fs_prime_pool_get(uint8_t * prime, uint8_t size)
+{
+	uint8_t i, j;
+	uint8_t zero[16];
+
+	for (i = 0; i < RSA_PRIME_POOL; i++) {
+		if (fs_prime_pool_size(i) != size)
+			continue;
+		sec_device_read_block(prime, offsetof(struct sec_device, pool[i].prime), size);
+		// invalidate slot first, then clear prime (size is multiple of 16)
+		memset(zero, 0, sizeof(zero));
+		sec_device_write_block(zero, offsetof(struct sec_device, pool[i].size), 1);
+		for (j = 0; j < size; j += sizeof(zero))
+			sec_device_write_block(zero,
+					       offsetof(struct sec_device, pool[i].prime) + j,
+					       sizeof(zero));
+		return size;
+	}
+	return 0;
+}
+#endif
+
 uint16_t fs_get_access_condition(void)
 {
 	if (get_lifecycle() == 1)
@@ -197,6 +492,7 @@ static void set_lifecycle(uint8_t lc)
 	temp = get_lifecycle();
 	if (temp != local_lc)
 		sec_device_write_block(&local_lc, offsetof(struct sec_device, lifecycle), 1);
+	acl_cache.valid = 0;
 }
 
 static uint8_t is_DF(struct fs_response *entry)
@@ -259,6 +555,7 @@ static uint8_t is_DF(struct fs_response *entry)
 // or return on collision RET_SEARCH_OK is returned. Here parent and the immediate children of the parent DF
 // are not tested, because ISO7816 this explicitly does not need (here is formulation "shall be" .. )
 // entry - not relevant (will be filled with data witch colided object (EF/DF) or end of filesystem
+//         (end of files in FLASH, session objects are searched too)
 // id    - ID for test, if there is any collision
 // data  - not relevant (NULL)
 // type  - S_MAX
@@ -301,6 +598,18 @@ static uint8_t is_DF(struct fs_response *entry)
 // type  - S_UUID
 #define S_UUID  15
 
+// list files in current DF with file information (records FS_INFO_LEN bytes:
+// ID, type, size, ACL, proprietary info)
+// entry - must be filled with DF data of the current DF
+// id    - number of files to skip
+// data  - buffer for FS_INFO_MAX records
+// type  - S_LIST_INFO
+// RETURN - RET_SEARCH_END, entry->fs.id = number of records, entry->fs.size =
+//          number of not listed files (max 255)
+#define S_LIST_INFO  16
+#define FS_INFO_LEN  10
+#define FS_INFO_MAX  25
+
 #define RET_SEARCH_FAIL 2
 #define RET_SEARCH_END  1
 #define RET_SEARCH_OK	0
@@ -315,6 +624,7 @@ static uint8_t fs_search_file(struct fs_response *entry, uint16_t id, uint8_t *
 	uint16_t uuid = entry->fs.uuid;
 	uint16_t p_uuid = entry->fs.parent_uuid;
 	uint8_t data_count = 0;
+	uint8_t more = 0;
 	uint8_t fname[16];
 	uint16_t code = id;
 	uint16_t offset = 0;
@@ -337,7 +647,7 @@ static uint8_t fs_search_file(struct fs_response *entry, uint16_t id, uint8_t *
 		data++;
 	}
 	response.mem_offset = 0;
-	while (0 == device_read_block(&response, response.mem_offset, sizeof(struct fs_data))) {
+	while (0 == fs_read_block(&response, response.mem_offset, sizeof(struct fs_data))) {
 		DPRINT
 		    ("%s searched ID/code %04x, filesystem id %04x uuid %04x parent ID %04x %s\n",
 		     __FUNCTION__, id, response.fs.id, response.fs.uuid,
@@ -355,11 +665,19 @@ static uint8_t fs_search_file(struct fs_response *entry, uint16_t id, uint8_t *
 				response.fs.id = offset;
 				goto fs_search_file_ok;
 			}
+			if (response.mem_offset < FS_SESSION_BASE) {
+				// end of files in FLASH (place for new file)
+				if (type == S_MAX)
+					entry->mem_offset = response.mem_offset;
+#ifdef FS_SESSION_SIZE
+				// continue with session objects
+				response.mem_offset = FS_SESSION_BASE;
+				continue;
+#endif
+			}
 			// not successful search, fill maximal uuid
-			if (type == S_MAX) {
+			if (type == S_MAX)
 				entry->fs.uuid = max_uuid + 1;
-				entry->mem_offset = response.mem_offset;
-			}
 			DPRINT("%s filesystem end\n", __FUNCTION__);
 			if (type == S_0) {
 				if (level != 0) {
@@ -368,8 +686,10 @@ static uint8_t fs_search_file(struct fs_response *entry, uint16_t id, uint8_t *
 					return RET_SEARCH_OK;
 				}
 			}
-			if (type == S_LIST_ALL)
+			if (type == S_LIST_ALL || type == S_LIST_INFO)
 				entry->fs.id = data_count;
+			if (type == S_LIST_INFO)
+				entry->fs.size = more;
 			return RET_SEARCH_END;
 		}
 		offset = 0;
@@ -409,6 +729,27 @@ static uint8_t fs_search_file(struct fs_response *entry, uint16_t id, uint8_t *
 						}
 			goto fs_search_file_cont;
 		}
+		if (type == S_LIST_INFO) {
+			if (response.fs.parent_uuid == uuid && response.fs.id != 0x3f00) {
+				if (code) {
+					code--;
+				} else if (data_count < FS_INFO_MAX) {
+					*data++ = response.fs.id >> 8;
+					*data++ = response.fs.id & 255;
+					*data++ = response.fs.type;
+					*data++ = response.fs.size >> 8;
+					*data++ = response.fs.size & 255;
+					memcpy(data, response.fs.acl, 3);
+					data += 3;
+					*data++ = response.fs.prop >> 8;
+					*data++ = response.fs.prop & 255;
+					data_count++;
+				} else if (more < 255) {
+					more++;
+				}
+			}
+			goto fs_search_file_cont;
+		}
 		// test filename
 		if (type == S_NAME) {
 			uint8_t name_size = response.fs.name_size;
@@ -422,9 +763,9 @@ static uint8_t fs_search_file(struct fs_response *entry, uint16_t id, uint8_t *
 			if (name_size == data_count) {
 				// coverity[overrun-buffer-val]
 				if (0 ==
-				    device_read_block(fname,
-						      response.mem_offset +
-						      sizeof(struct fs_data), name_size)) {
+				    fs_read_block(fname,
+						  response.mem_offset +
+						  sizeof(struct fs_data), name_size)) {
 					if (0 == memcmp(data, fname, name_size))
 						goto fs_search_file_ok;
 				}
@@ -850,6 +1191,7 @@ uint8_t fs_verify_pin(uint8_t * message)
 		security_enable |= SEC_ENABLE_ADMIN;
 	if (r & (1 << PIN_UNLOCKER))
 		security_enable |= SEC_ENABLE_UNBLOCK;
+	acl_cache.valid = 0;
 	return S_RET_OK;
 }
 
@@ -947,9 +1289,10 @@ uint8_t fs_initialize_pin(uint8_t * message)
 
 //if allowed return 0  (file must be selected .. )
 
-static uint8_t check_EF_security(uint8_t type)
+// nibble: 0 = acl[0] >> 4, 1 = acl[0] & 0xf, 2 = acl[1] >> 4, 3 = acl[1] & 0xf
+static uint8_t check_acl_cached(uint8_t nibble)
 {
-	DPRINT("%s\n", __FUNCTION__);
+	uint8_t i, ac;
 
 	if (fci_sel.fs.id == 0xffff)
 		return 1;
@@ -957,14 +1300,36 @@ static uint8_t check_EF_security(uint8_t type)
 	DPRINT("selected %04X ACL=%02X%02X%02X\n", fci_sel.fs.id,
 	       fci_sel.fs.acl[0], fci_sel.fs.acl[1], fci_sel.fs.acl[2]);
 
+	if (!acl_cache.valid || acl_cache.acl[0] != fci_sel.fs.acl[0]
+	    || acl_cache.acl[1] != fci_sel.fs.acl[1]) {
+		acl_cache.acl[0] = fci_sel.fs.acl[0];
+		acl_cache.acl[1] = fci_sel.fs.acl[1];
+		acl_cache.allowed = 0;
+		for (i = 0; i < 4; i++) {
+			ac = fci_sel.fs.acl[i >> 1];
+			if (!(i & 1))
+				ac >>= 4;
+			if (0 == check_security_pin_ac(ac & 0xf))
+				acl_cache.allowed |= 1 << i;
+		}
+		acl_cache.valid = 1;
+		DPRINT("ACL cache updated %02X\n", acl_cache.allowed);
+	}
+	return !(acl_cache.allowed & (1 << nibble));
+}
+
+static uint8_t check_EF_security(uint8_t type)
+{
+	DPRINT("%s\n", __FUNCTION__);
+
 	if (type == SEC_READ)
-		return (check_security_pin_ac(fci_sel.fs.acl[0] >> 4));
+		return check_acl_cached(0);
 	if (type == SEC_UPDATE)
-		return (check_security_pin_ac(fci_sel.fs.acl[0] & 0xf));
+		return check_acl_cached(1);
 	if (type == SEC_DELETE)
-		return (check_security_pin_ac(fci_sel.fs.acl[1] >> 4));
+		return check_acl_cached(2);
 	if (type == SEC_GENERATE)
-		return (check_security_pin_ac(fci_sel.fs.acl[1] & 0xf));
+		return check_acl_cached(3);
 	return 1;
 }
 
@@ -972,18 +1337,12 @@ static uint8_t check_DF_security(uint8_t type)
 {
 	DPRINT("%s\n", __FUNCTION__);
 
-	if (fci_sel.fs.id == 0xffff)
-		return 1;
-
-	DPRINT("selected %04X ACL=%02X%02X%02X\n", fci_sel.fs.id,
-	       fci_sel.fs.acl[0], fci_sel.fs.acl[1], fci_sel.fs.acl[2]);
-
 	if (type == SEC_CREATE_DF)
-		return (check_security_pin_ac(fci_sel.fs.acl[0] & 0xf));
+		return check_acl_cached(1);
 	if (type == SEC_CREATE_EF)
-		return (check_security_pin_ac(fci_sel.fs.acl[0] >> 4));
+		return check_acl_cached(0);
 	if (type == SEC_DELETE)
-		return (check_security_pin_ac(fci_sel.fs.acl[1] >> 4));
+		return check_acl_cached(2);
 	return 1;
 }
 
@@ -1047,6 +1406,9 @@ static void fs_mkfs(uint8_t * message)
 	if (sec_device_format())
 		for (;;) ;
 
+	// host must invalidate whole cache
+	fs_journal_add(0x3f00, 0);
+
 	// lifecycle must be set to 1 because no pins exists..
 
 	set_lifecycle(1);
@@ -1063,16 +1425,26 @@ uint8_t fs_erase_card(uint8_t * acl)
 			return S0x6982;	//security status not satisfied
 	}
 	device_format();
+#ifdef FS_SESSION_SIZE
+	memset(fs_session, 0xff, FS_SESSION_SIZE);
+#endif
+	fs_tree.active = 0;
 	fs_mkfs(acl);
 	return S_RET_OK;
 }
 
+static void fs_grow_clean(void);
+
 void fs_init(void)
 {
 	// test if some of security data are in tact
 	uint16_t i;
 	uint8_t val = 255, s;
 
+#ifdef FS_SESSION_SIZE
+	// session objects are removed at card reset
+	memset(fs_session, 0xff, FS_SESSION_SIZE);
+#endif
 	for (i = 0; i < SEC_MEM_SIZE; i++) {
 		sec_device_read_block(&s, i, 1);
 		val &= s;
@@ -1086,6 +1458,12 @@ void fs_init(void)
 				fs_mkfs(NULL);
 	}
 	security_enable = 0;	//nothing enabled
+	acl_cache.valid = 0;
+	fs_tree.active = 0;
+	sec_device_read_block(&s, offsetof(struct sec_device, tree), 1);
+	if (s == 0)
+		fs_tree_clean();
+	fs_grow_clean();
 	// select MF after ATR (to conform ISO)
 	fci_sel.fs.uuid = 0;
 	// TODO check return value
@@ -1148,9 +1526,9 @@ static uint8_t fs_get_fci(struct iso7816_response *r)
 			r->data[25] = 0x84;
 			r->data[26] = fci_sel.fs.name_size;
 			if (1 ==
-			    device_read_block(r->data + 27,
-					      fci_sel.mem_offset + sizeof(struct fs_data),
-					      fci_sel.fs.name_size))
+			    fs_read_block(r->data + 27,
+					  fci_sel.mem_offset + sizeof(struct fs_data),
+					  fci_sel.fs.name_size))
 				return S0x6581;	// memory fail
 		}
 		RESP_READY(r->data[1] + 2);
@@ -1185,9 +1563,9 @@ static uint8_t fs_get_fci(struct iso7816_response *r)
 		*(position++) = 0x84;
 		*(position++) = fci_sel.fs.name_size;
 		if (1 ==
-		    device_read_block(position,
-				      fci_sel.mem_offset + sizeof(struct fs_data),
-				      fci_sel.fs.name_size))
+		    fs_read_block(position,
+				  fci_sel.mem_offset + sizeof(struct fs_data),
+				  fci_sel.fs.name_size))
 			return S0x6581;	// memory fail
 		position += fci_sel.fs.name_size;
 	}
@@ -1350,7 +1728,7 @@ static uint8_t fs_key_part(uint16_t * offset, uint8_t part)
 	*offset = fci_sel.mem_offset;
 	*offset += sizeof(struct fs_data);
 	while (flen > 2) {
-		if (device_read_block(tl, *offset, 2))
+		if (fs_read_block(tl, *offset, 2))
 			return C_KEYp_WRONG;
 		if (tl[0] == 0xff)
 			return C_KEYp_FREE;
@@ -1370,6 +1748,19 @@ static uint8_t fs_key_part(uint16_t * offset, uint8_t part)
 
 // read key part (tagged by 'type') and return part len (or 0 if error)
 // if key == NULL return only part size
+#ifdef RSA_PRIME_POOL
+// prime generation is allowed only if the selected file is RSA key file
+// with generate access (same condition as key generation)
+uint8_t fs_prime_pool_check(void)
+{
+	if (fci_sel.fs.id == 0xffff || fci_sel.fs.type != RSA_KEY_EF)
+		return S0x6985;	// condition of use not satisfied
+	if (check_EF_security(SEC_GENERATE))
+		return S0x6982;	//security status not satisfied
+	return S_RET_OK;
+}
+#endif
+
 uint16_t fs_key_read_part(uint8_t * key, uint8_t type)
 {
 	uint16_t offset;
@@ -1383,11 +1774,11 @@ uint16_t fs_key_read_part(uint8_t * key, uint8_t type)
 	type &= (uint8_t) ~ KEY_GENERATE;
 	if (C_KEYp_EXIST == fs_key_part(&offset, type)) {
 		offset++;
-		if (device_read_block(&size, offset, 1))
+		if (fs_read_block(&size, offset, 1))
 			return 0;
 		offset++;
 		if (key)
-			if (device_read_block(key, offset, size))
+			if (fs_read_block(key, offset, size))
 				return 0;
 		if (size == 0)
 			return 256;
@@ -1409,16 +1800,17 @@ uint8_t fs_key_change_type(void)
 	if (fci_sel.fs.type != 0x22)
 		return S0x6985;	// condition of use not satisfied
 	fci_sel.fs.type = 0x23;
-	if (device_write_block(&fci_sel.fs, fci_sel.mem_offset, sizeof(struct fs_data)))
+	if (fs_write_block(&fci_sel.fs, fci_sel.mem_offset, sizeof(struct fs_data)))
 		return S0x6581;	//memory fail
-
+	fs_journal_add(fci_sel.fs.id, fci_sel.mem_offset);
 	return S_RET_OK;
 }
 #endif
 
-uint8_t fs_key_write_part(uint8_t * key)
+// check access, find free space for new key part (key[0] type, key[1] size)
+// offset is set to position of key part TAG
+static uint8_t fs_key_part_alloc(uint8_t * key, uint16_t * offset)
 {
-	uint16_t offset;
 	uint16_t prop_flag = fci_sel.fs.prop;
 
 #define K_TYPE key[0]
@@ -1443,7 +1835,7 @@ uint8_t fs_key_write_part(uint8_t * key)
 	}
 
 	// allow only write to free space in key file
-	if (C_KEYp_FREE != fs_key_part(&offset, K_TYPE)) {
+	if (C_KEYp_FREE != fs_key_part(offset, K_TYPE)) {
 		DPRINT("key part 0x%02x already exists\n", K_TYPE);
 		return S0x6984;	//invalid data
 	}
@@ -1455,23 +1847,90 @@ uint8_t fs_key_write_part(uint8_t * key)
 	// write fci back if prop flag was changed
 	if (prop_flag != fci_sel.fs.prop) {
 		fci_sel.fs.prop = prop_flag;
-		if (device_write_block(&fci_sel.fs, fci_sel.mem_offset, sizeof(struct fs_data)))
+		if (fs_write_block(&fci_sel.fs, fci_sel.mem_offset, sizeof(struct fs_data)))
 			return S0x6581;	//memory fail
 	}
 
-	uint16_t size_test = offset - fci_sel.mem_offset;
+	uint16_t size_test = *offset - fci_sel.mem_offset;
 
 	if (size_test + K_SIZE > fci_sel.fs.size)
 		return S0x6b00;	//outside EF
 
-	if (1 == device_write_block(key, offset, K_SIZE + 2))
-		return S0x6581;	//memory fail
-
 	return S_RET_OK;
 #undef K_TYPE
 #undef K_SIZE
 }
 
+uint8_t fs_key_write_part(uint8_t * key)
+{
+	uint16_t offset;
+	uint8_t ret;
+
+	ret = fs_key_part_alloc(key, &offset);
+	if (ret != S_RET_OK)
+		return ret;
+
+	if (1 == fs_write_block(key, offset, key[1] + 2))
+		return S0x6581;	//memory fail
+
+	fs_journal_add(fci_sel.fs.id, fci_sel.mem_offset);
+	return S_RET_OK;
+}
+
+// Streamed key part write: value of part is written in blocks, TAG and LEN
+// are written in fs_key_part_commit(). Until commit, key part is not
+// visible (free space TAG 0xff is not changed).  VAL area is cleared
+// (data from interrupted upload must not be parsed as next key part).
+uint8_t fs_key_part_begin(uint8_t * key, uint16_t * offset)
+{
+	uint8_t ret;
+
+	ret = fs_key_part_alloc(key, offset);
+	if (ret != S_RET_OK)
+		return ret;
+	return fs_key_part_abort(key, *offset);
+}
+
+// clear VAL area of not yet commited key part
+uint8_t fs_key_part_abort(uint8_t * key, uint16_t offset)
+{
+	if (fs_write_ff(offset + 2, key[1]))
+		return S0x6581;	//memory fail
+	return S_RET_OK;
+}
+
+// read/write block of not yet commited key part (pos - position in VAL)
+uint8_t fs_key_part_write(uint16_t offset, uint8_t pos, uint8_t * data, uint8_t len)
+{
+	if (!len)
+		return S_RET_OK;
+	if (fs_write_block(data, offset + 2 + pos, len))
+		return S0x6581;	//memory fail
+	return S_RET_OK;
+}
+
+uint8_t fs_key_part_read(uint16_t offset, uint8_t pos, uint8_t * data, uint8_t len)
+{
+	if (!len)
+		return S_RET_OK;
+	if (fs_read_block(data, offset + 2 + pos, len))
+		return S0x6581;	//memory fail
+	return S_RET_OK;
+}
+
+uint8_t fs_key_part_commit(uint8_t * key, uint16_t offset)
+{
+	uint16_t test;
+
+	// file or key part may be changed between begin and commit
+	if (C_KEYp_FREE != fs_key_part(&test, key[0]) || test != offset)
+		return S0x6984;	//invalid data
+	if (fs_write_block(key, offset, 2))
+		return S0x6581;	//memory fail
+	fs_journal_add(fci_sel.fs.id, fci_sel.mem_offset);
+	return S_RET_OK;
+}
+
 static uint8_t fs_transparent_file(void)
 {
 	// do not test shareable file flag
@@ -1511,14 +1970,19 @@ uint8_t fs_read_binary(uint16_t offset, struct iso7816_response *r)
 	offset += sizeof(struct fs_data);
 	offset += fci_sel.fs.name_size;
 
-	if (1 == device_read_block(r->data, offset, dlen & 0xff))
+	if (1 == fs_read_block(r->data, offset, dlen & 0xff))
 		return S0x6581;	// Memory failure, do not return 0x6281 - part of data is corrupted
 	RESP_READY(dlen);
 }
 
+// transparent EF, UPDATE BINARY behind end of file extends the file
+#define FS_PROP_AUTOSIZE 0x0100
+static uint8_t fs_grow(uint16_t size);
+
 uint8_t fs_update_binary(uint8_t * buffer, uint16_t offset)
 {
 	uint8_t dlen = *buffer;
+	uint8_t ret;
 
 	DPRINT("%s\n", __FUNCTION__);
 
@@ -1534,30 +1998,40 @@ uint8_t fs_update_binary(uint8_t * buffer, uint16_t offset)
 	if (check_EF_security(SEC_UPDATE))
 		return S0x6982;	//security status not satisfied
 
-	if (offset + dlen > fci_sel.fs.size)
-		return S0x6b00;	//outside EF
+	if (offset + dlen > fci_sel.fs.size) {
+		if (!(fci_sel.fs.prop & FS_PROP_AUTOSIZE))
+			return S0x6b00;	//outside EF
+		ret = fs_grow(offset + dlen);
+		if (ret != S_RET_OK)
+			return ret;
+	}
 
 	offset += fci_sel.mem_offset;
 	offset += sizeof(struct fs_data);
 	offset += fci_sel.fs.name_size;
 
-	if (1 == device_write_block(buffer, offset, dlen))
+	if (1 == fs_write_block(buffer, offset, dlen))
 		return S0x6581;	//memory fail
+	fs_journal_add(fci_sel.fs.id, fci_sel.mem_offset);
 	return S_RET_OK;
 }
 
 static uint8_t fs_ff(uint16_t offset, uint16_t size)
 {
+	// fs_write_ff() interprets size 0 as 256
+	if (!size)
+		return S_RET_OK;
+
 	card_io_start_null();
 
 	while (size > 256) {
-		if (device_write_ff(offset, 0))
+		if (fs_write_ff(offset, 0))
 			return S0x6581;	//memory fail
 		offset += 256;
 		size -= 256;
 	}
 
-	if (device_write_ff(offset, size))
+	if (fs_write_ff(offset, size))
 		return S0x6581;	//memory fail
 	return S_RET_OK;
 }
@@ -1580,10 +2054,205 @@ uint8_t fs_erase_binary(uint16_t offset)
 	if (offset > fci_sel.fs.size)
 		return S0x6b00;	//outside EF
 	size = fci_sel.fs.size - offset;
+	if (!size)
+		return S_RET_OK;
 	offset += fci_sel.mem_offset;
 	offset += sizeof(struct fs_data);
 	offset += fci_sel.fs.name_size;
-	return fs_ff(offset, size);
+	if (fs_ff(offset, size))
+		return S0x6581;	//memory fail
+	fs_journal_add(fci_sel.fs.id, fci_sel.mem_offset);
+	return S_RET_OK;
+}
+
+// offset of file header following file "fs" at "offset"
+static uint16_t fs_next_offset(struct fs_data *fs, uint16_t offset)
+{
+	offset += sizeof(struct fs_data) + fs->name_size;
+	if (!fs->no_allocate)
+		offset += fs->size;
+	return offset;
+}
+
+// space for "size" bytes at offset and for header of next file (end of
+// filesystem), files in FLASH must not overrun session objects area
+static uint8_t fs_no_space(uint16_t offset, uint16_t size)
+{
+	uint32_t end = (uint32_t) offset + size + sizeof(struct fs_data);
+	uint8_t tmp;
+
+#ifdef FS_SESSION_SIZE
+	if (offset < FS_SESSION_BASE && end >= FS_SESSION_BASE)
+		return 1;
+#endif
+	if (end > 0xffff)
+		return 1;
+	return fs_read_block(&tmp, end, 1);
+}
+
+// make sure the filesystem ends at offset
+static uint8_t fs_mark_end(uint16_t offset)
+{
+	uint16_t id;
+
+	if (fs_read_block(&id, offset, sizeof(id)))
+		return 1;
+	if (id == 0xffff)
+		return 0;
+	DPRINT("%s clearing stale file header at %04x\n", __FUNCTION__, offset);
+	return fs_write_ff(offset, sizeof(struct fs_data));
+}
+
+#ifdef FS_SESSION_SIZE
+// end of session objects list (place for new session object)
+static uint16_t fs_session_end(void)
+{
+	struct fs_data *fs;
+	uint16_t offset = FS_SESSION_BASE;
+
+	for (;;) {
+		fs = (struct fs_data *)(fs_session + (offset - FS_SESSION_BASE));
+		if (fs->id == 0xffff)
+			return offset;
+		offset = fs_next_offset(fs, offset);
+	}
+}
+
+// remove deleted session objects
+static void fs_session_compact(void)
+{
+	struct fs_data *fs;
+	uint16_t pos = 0, next, end = fs_session_end() - FS_SESSION_BASE;
+
+	while (pos < end) {
+		fs = (struct fs_data *)(fs_session + pos);
+		next = fs_next_offset(fs, pos);
+		if (fs->active) {
+			pos = next;
+			continue;
+		}
+		DPRINT("%s removing session object UUID %04x\n", __FUNCTION__, fs->uuid);
+		memmove(fs_session + pos, fs_session + next, end - next);
+		memset(fs_session + end - (next - pos), 0xff, next - pos);
+		end -= next - pos;
+	}
+}
+#endif
+
+/*
+Auto size EF (transparent EF with FS_PROP_AUTOSIZE in proprietary info)
+
+UPDATE BINARY behind the end of file extends the file.  The file data are
+always continuous (READ BINARY is simple offset calculation), the last file
+(in FLASH or in RAM list) is extended in place, other files are moved to
+the end of list first (data are copied, then the new header is written and
+the old header is marked as deleted).
+*/
+static uint8_t fs_grow(uint16_t size)
+{
+	struct fs_response end;
+	struct fs_data fs;
+	uint16_t from, to, pos, data;
+	uint8_t buffer[32];
+	uint8_t len;
+
+	DPRINT("%s %04x: %d -> %d bytes\n", __FUNCTION__, fci_sel.fs.id, fci_sel.fs.size, size);
+
+	if (size > 32767)
+		return S0x6b00;	//outside EF
+
+	// free space behind filesystem is used, drop uncommitted file tree
+	fs_tree_abort();
+
+	from = fci_sel.mem_offset;
+	memcpy(&fs, &fci_sel.fs, sizeof(struct fs_data));
+	fs.size = size;
+
+	// last file ?
+	if (fs_read_block(&to, fs_next_offset(&fci_sel.fs, from), sizeof(to)))
+		return S0x6581;	//memory fail
+	if (to == 0xffff) {
+		to = from;
+	} else {
+#ifdef FS_SESSION_SIZE
+		if (from >= FS_SESSION_BASE)
+			to = fs_session_end();
+		else
+#endif
+		{
+			// end of filesystem (0xffff is never in collision)
+			if (RET_SEARCH_END != fs_search_file(&end, 0xffff, NULL, S_MAX))
+				return S0x6581;	//memory fail
+			to = end.mem_offset;
+		}
+	}
+	if (fs_no_space(to, sizeof(struct fs_data) + fs.name_size + size))
+		return S0x6b00;	//outside EF
+
+	card_io_start_null();
+
+	data = sizeof(struct fs_data) + fs.name_size;
+	if (to != from) {
+		DPRINT("%s moving file from %04x to %04x\n", __FUNCTION__, from, to);
+		for (pos = 0; pos < fci_sel.fs.size; pos += len) {
+			len = sizeof(buffer);
+			if (fci_sel.fs.size - pos < len)
+				len = fci_sel.fs.size - pos;
+			if (fs_read_block(buffer, from + data + pos, len))
+				return S0x6581;	//memory fail
+			if (fs_write_block(buffer, to + data + pos, len))
+				return S0x6581;	//memory fail
+		}
+	}
+	// new part of file is empty
+	if (fs_ff(to + data + fci_sel.fs.size, size - fci_sel.fs.size))
+		return S0x6581;	//memory fail
+	if (fs_mark_end(fs_next_offset(&fs, to)))
+		return S0x6581;	//memory fail
+	if (fs_write_block(&fs, to, sizeof(struct fs_data)))
+		return S0x6581;	//memory fail
+	if (to != from) {
+		// mark old copy as deleted
+		fci_sel.fs.active = 0;
+		if (fs_write_block(&fci_sel.fs, from, sizeof(struct fs_data)))
+			return S0x6581;	//memory fail
+#ifdef FS_SESSION_SIZE
+		fs_session_compact();
+#endif
+	}
+	// reselect file (new position)
+	if (RET_SEARCH_OK != fs_search_file(&fci_sel, fs.uuid, NULL, S_UUID))
+		return S0x6581;	//memory fail
+	return S_RET_OK;
+}
+
+// fs_grow() writes header of moved file at the end of filesystem, then the
+// old copy is marked as deleted.  If this is interrupted by card reset, the
+// last file in FLASH has same UUID as an older (active) copy, delete it.
+static void fs_grow_clean(void)
+{
+	struct fs_data fs, last;
+	struct fs_response fr;
+	uint16_t offset = 0, last_offset = 0xffff;
+
+	for (;;) {
+		if (fs_read_block(&fs, offset, sizeof(struct fs_data)))
+			return;
+		if (fs.id == 0xffff)
+			break;
+		memcpy(&last, &fs, sizeof(struct fs_data));
+		last_offset = offset;
+		offset = fs_next_offset(&fs, offset);
+	}
+	if (last_offset == 0xffff || !last.active)
+		return;
+	if (RET_SEARCH_OK != fs_search_file(&fr, last.uuid, NULL, S_UUID))
+		return;
+	if (fr.mem_offset == last_offset)
+		return;
+	DPRINT("%s deleting old copy of %04x at %04x\n", __FUNCTION__, fr.fs.id, fr.mem_offset);
+	fr.fs.active = 0;
+	fs_write_block(&fr.fs, fr.mem_offset, sizeof(struct fs_data));
 }
 
 // DF subtree delete is not very effective, because small ram, there is no way to do
@@ -1595,8 +2264,10 @@ static uint8_t fs_delete_this_ef_df(struct fs_response *desc)
 	DPRINT("%s DELETING ID %04x\n", __FUNCTION__, desc->fs.id);
 	// mark file as deleted
 	desc->fs.active = 0;
-	if (device_write_block(&desc->fs, desc->mem_offset, sizeof(struct fs_data)))
+	if (fs_write_block(&desc->fs, desc->mem_offset, sizeof(struct fs_data)))
 		return 1;	//memory fail
+	// each file of deleted subtree is journaled (children may be cached)
+	fs_journal_add(desc->fs.id, desc->mem_offset);
 	return 0;
 }
 
@@ -1671,6 +2342,10 @@ uint8_t fs_delete_file(void)
 		return S0x6581;	//memory fail
 	// select parent
 	memcpy(&fci_sel, &parent, sizeof(struct fs_response));
+#ifdef FS_SESSION_SIZE
+	// parent is DF (always in FLASH), session objects can be moved
+	fs_session_compact();
+#endif
 	// reclaim free space at end of filesystem
 	// coverity[check_return]
 	fs_search_file(&file, 0, NULL, S_SPACE);
@@ -1683,48 +2358,17 @@ uint8_t fs_delete_file(void)
 	return S_RET_OK;
 }
 
-uint8_t fs_create_file(uint8_t * buffer)
+// parse FCP (buffer points to FCP data, after tag 0x62 and length),
+// fs->parent_uuid, fs->uuid is not changed, df_name is set to name length
+// byte followed by name (or NULL)
+static uint8_t fs_parse_fcp(uint8_t * buffer, uint8_t xlen, struct fs_data *fs, uint8_t ** df_name)
 {
-	struct fs_response fr1;
-	struct fs_data fs;
-	uint8_t xlen;
 	uint8_t flag = 0;
 	uint8_t type = 0;
-	uint8_t *df_name = NULL;
 	uint8_t tag;
 	uint8_t dlen;
 
-	DPRINT("%s\n", __FUNCTION__);
-
-	if (fci_sel.fs.id == 0xffff)
-		return S0x6a82;	//file not found
-
-	// FCP too small ?
-	dlen = *(buffer++);
-	if (dlen < 2)
-		return S0x6984;	//invalid data
-
-	// test if FCP template is in buffer
-	tag = *(buffer++);
-	if (tag != 0x62)
-		return S0x6984;	//invalid data
-
-	// length of FCP template must match LC
-	// TODO this may fail for FCP over 127 bytes (len value in two bytes)
-	xlen = *(buffer++);
-	if (dlen - 2 != xlen)
-		return S0x6984;	//invalid data
-
-	memcpy(&fr1, &fci_sel, sizeof(struct fs_response));
-	// is already selected file DF ? if not, reselect to parent DF first
-	if (!is_DF(&fr1))
-		if (RET_SEARCH_OK != fs_search_file(&fr1, 0, NULL, S_PARENT))
-			return S0x6a82;
-
-	memset(&fs, 0, sizeof(struct fs_data));
-	fs.parent_uuid = fr1.fs.uuid;
-	fs.active = 1;
-
+	*df_name = NULL;
 	for (;;) {
 		DPRINT("%s need to parse %d bytes\n", __FUNCTION__, xlen);
 // no more data ?
@@ -1756,7 +2400,7 @@ uint8_t fs_create_file(uint8_t * buffer)
 			// ISO7816 allow here exact two bytes for length
 			if (dlen != 2)
 				return S0x6984;	//invalid data
-			fs.tag_80_81 = 1;	// 1 = DF/EF key  0 = EF size
+			fs->tag_80_81 = 1;	// 1 = DF/EF key  0 = EF size
 			// fall through
 // data bytes in file (excluding struct. info)
 		case 0x80:
@@ -1766,9 +2410,9 @@ uint8_t fs_create_file(uint8_t * buffer)
 			if (flag & 1)
 				return S0x6984;	//invalid data  (duplicate tag 0x80/0x81)
 			flag |= 1;
-			fs.size = asn_get_uint_var(buffer, dlen);
+			fs->size = asn_get_uint_var(buffer, dlen);
 // limit filesize
-			if (fs.size > 32767)
+			if (fs->size > 32767)
 				return S0x6984;	//invalid data
 			break;
 // File descriptor byte (ISO7816 allow here up to 6 bytes, only 1st byte is used in OsEID)
@@ -1776,7 +2420,7 @@ uint8_t fs_create_file(uint8_t * buffer)
 			if (dlen > 6)
 				return S0x6984;	//invalid data
 			type = *buffer;
-			fs.type = type;
+			fs->type = type;
 			// mask shareable bit
 			type &= 0xbf;
 			// allow only supported file types
@@ -1791,14 +2435,14 @@ uint8_t fs_create_file(uint8_t * buffer)
 			// ISO7816 allow here exact two bytes for length
 			if (dlen != 2)
 				return S0x6984;	//invalid data
-			fs.id = asn_get_uint16(buffer);
-			if (fs.id == 0x3fff)	// current DF (ISO7816-4/5.3.1.1)
+			fs->id = asn_get_uint16(buffer);
+			if (fs->id == 0x3fff)	// current DF (ISO7816-4/5.3.1.1)
 				return S0x6984;	//invalid data
-			if (fs.id == 0)
+			if (fs->id == 0)
 				return S0x6984;	//invalid data
-			if (fs.id == 0x3f00)	// MF
+			if (fs->id == 0x3f00)	// MF
 				return S0x6984;	//invalid data
-			if (fs.id == 0xffff)	// RFU
+			if (fs->id == 0xffff)	// RFU
 				return S0x6984;	//invalid data
 			flag |= 4;
 			break;
@@ -1807,22 +2451,22 @@ uint8_t fs_create_file(uint8_t * buffer)
 			// request an exact length of 2 bytes, (ISO7816 allow var bytes here)
 			if (dlen != 2)
 				return S0x6984;	//invalid data
-			fs.prop = asn_get_uint16(buffer);
+			fs->prop = asn_get_uint16(buffer);
 			break;
 // ACL
 		case 0x86:
 			// request an exact length of 3 bytes, (ISO7816 allow var bytes here)
 			if (dlen != 3)
 				return S0x6984;	//invalid data
-			fs.acl[0] = buffer[0];
-			fs.acl[1] = buffer[1];
-			fs.acl[2] = buffer[2];
+			fs->acl[0] = buffer[0];
+			fs->acl[1] = buffer[1];
+			fs->acl[2] = buffer[2];
 			break;
 // filename
 		case 0x84:
 			// maximal tag len (16) is already checked, len is > 0 checked too
-			fs.name_size = dlen;
-			df_name = buffer - 1;
+			fs->name_size = dlen;
+			*df_name = buffer - 1;
 			break;
 			//lifecycle info (skip this, this is globally replaced by security mechanism)
 		case 0x8a:
@@ -1843,10 +2487,403 @@ uint8_t fs_create_file(uint8_t * buffer)
 	//DF checks
 	if (type == 0x38) {
 		// DF does not need allocate space
-		fs.no_allocate = 1;
+		fs->no_allocate = 1;
 		// DF need 0x81 tag ..
-		if (!fs.tag_80_81)
+		if (!fs->tag_80_81)
+			return S0x6984;	//invalid data
+	} else {
+		fs->no_allocate = 0;
+		// clear valid flag for key file (except 0x01 and 0x38 all file types are used for keys for now)
+		if (type != 1)
+			fs->prop &= 0xf0ff;
+		// EF does not have name
+		if (*df_name)
 			return S0x6984;	//invalid data
+		// EF size can be specified by 0x80 or 0x81 tag
+	}
+	return S_RET_OK;
+}
+
+#define TREE_TAG_FCP	0x62
+#define TREE_TAG_DATA	0x53
+#define TREE_TAG_UP	0x01
+
+static uint8_t fs_tree_read(struct fs_data *fs, uint16_t offset)
+{
+	if (offset == fs_tree.start) {
+		memcpy(fs, &fs_tree.first, sizeof(struct fs_data));
+		return 0;
+	}
+	return fs_read_block(fs, offset, sizeof(struct fs_data));
+}
+
+// search already created part of tree, collision of ID/DF name (fs = NULL:
+// search DF by UUID and return ACL)
+static uint8_t fs_tree_search(struct fs_data *new, uint8_t * df_name, struct fs_data *fs)
+{
+	uint8_t fname[16];
+	uint16_t offset;
+
+	for (offset = fs_tree.start; offset < fs_tree.end; offset = fs_next_offset(fs, offset)) {
+		if (fs_tree_read(fs, offset))
+			return RET_SEARCH_FAIL;
+		if (!new) {
+			if (fs->uuid == fs_tree.df)
+				return RET_SEARCH_OK;
+			continue;
+		}
+		if (fs->parent_uuid == new->parent_uuid && fs->id == new->id)
+			return RET_SEARCH_OK;
+		if (df_name && fs->name_size == *df_name) {
+			// coverity[overrun-buffer-val]
+			if (fs_read_block(fname, offset + sizeof(struct fs_data), fs->name_size))
+				return RET_SEARCH_FAIL;
+			if (0 == memcmp(fname, df_name + 1, fs->name_size))
+				return RET_SEARCH_OK;
+		}
+	}
+	return RET_SEARCH_END;
+}
+
+// 1st pass: check structure of block, space for all files, collisions with
+// already existing files (one walk over filesystem for all files in block)
+static uint8_t fs_tree_check(uint8_t * data, uint16_t len)
+{
+	struct tlv t;
+	struct fs_data fs, old;
+	uint8_t *df_name;
+	uint8_t fname[16];
+	uint8_t depth, ret, last_ef;
+	uint16_t offset;
+	// size of whole tree (including already written part), 32 bit to
+	// catch any number of 16 bit offset overflows
+	uint32_t total = fs_tree.end - fs_tree.start;
+
+	depth = fs_tree.depth;
+	last_ef = 0;
+	tlv_init(&t, data, len);
+	while ((ret = tlv_next(&t)) == TLV_OK) {
+		switch (t.tag) {
+		case TREE_TAG_FCP:
+			if (t.tag_len > 255)
+				return S0x6984;	//invalid data
+			memset(&fs, 0, sizeof(struct fs_data));
+			ret = fs_parse_fcp(t.value, t.tag_len, &fs, &df_name);
+			if (ret != S_RET_OK)
+				return ret;
+#ifdef FS_SESSION_SIZE
+			// tree is always created in FLASH
+			if (!fs.no_allocate && (fs.prop & FS_PROP_SESSION))
+				return S0x6984;	//invalid data
+#endif
+			total += sizeof(struct fs_data) + fs.name_size;
+			if (!fs.no_allocate)
+				total += fs.size;
+			if (total > 0xffffUL - fs_tree.start)
+				return S0x6985;	//condition not satisfied
+			last_ef = (fs.type & 0xbf) == 0x01;
+			if (fs.no_allocate)
+				depth++;
+			break;
+		case TREE_TAG_DATA:
+			// fs_write_block() size is limited to 255 bytes
+			if (!last_ef || t.tag_len > fs.size || t.tag_len > 255)
+				return S0x6984;	//invalid data
+			last_ef = 0;
+			break;
+		case TREE_TAG_UP:
+			if (!depth || t.tag_len)
+				return S0x6984;	//invalid data
+			depth--;
+			last_ef = 0;
+			break;
+		default:
+			return S0x6984;	//invalid data
+		}
+	}
+	if (ret == TLV_ERROR)
+		return S0x6984;	//invalid data
+
+	// there must be place for all files (+ header for test  - FS end)
+	if (fs_no_space(fs_tree.start, total))
+		return S0x6985;	//condition not satisfied
+
+	// collisions with existing files: ID of files created in root DF, DF names
+	offset = 0;
+	for (;;) {
+		if (offset == fs_tree.start) {
+#ifdef FS_SESSION_SIZE
+			// continue with session objects
+			offset = FS_SESSION_BASE;
+#else
+			break;
+#endif
+		}
+		if (fs_read_block(&old, offset, sizeof(struct fs_data)))
+			return S0x6581;	//memory fail
+		if (old.id == 0xffff)
+			break;
+		if (old.name_size)
+			// coverity[overrun-buffer-val]
+			if (fs_read_block
+			    (fname, offset + sizeof(struct fs_data), old.name_size))
+				return S0x6581;	//memory fail
+		if (old.active) {
+			depth = fs_tree.depth;
+			tlv_init(&t, data, len);
+			while (tlv_next(&t) == TLV_OK) {
+				if (t.tag == TREE_TAG_UP)
+					depth--;
+				if (t.tag != TREE_TAG_FCP)
+					continue;
+				memset(&fs, 0, sizeof(struct fs_data));
+				fs_parse_fcp(t.value, t.tag_len, &fs, &df_name);
+				if (!depth && old.parent_uuid == fs_tree.root && old.id == fs.id)
+					return S0x6a89;	//already exists
+				if (df_name && old.name_size == *df_name)
+					if (0 == memcmp(fname, df_name + 1, old.name_size))
+						return S0x6a89;	//already exists
+				if (fs.no_allocate)
+					depth++;
+			}
+		}
+		offset = fs_next_offset(&old, offset);
+	}
+	return S_RET_OK;
+}
+
+// mark tree in progress in sec_device (0), tree finished (0xff)
+static void fs_tree_pending(uint8_t val)
+{
+	uint8_t old;
+
+	sec_device_read_block(&old, offsetof(struct sec_device, tree), 1);
+	if (old != val)
+		sec_device_write_block(&val, offsetof(struct sec_device, tree), 1);
+}
+
+// Tree interrupted by card reset: data of already written files are left
+// in free space behind the end of filesystem, erase them.
+static void fs_tree_clean(void)
+{
+	struct fs_response fr;
+	uint8_t buffer[32];
+	uint16_t offset;
+	uint8_t i;
+
+	fr.fs.uuid = 0;
+	if (RET_SEARCH_END != fs_search_file(&fr, 0xffff, NULL, S_MAX))
+		return;
+	DPRINT("%s free space from %04x\n", __FUNCTION__, fr.mem_offset);
+	for (offset = fr.mem_offset; offset < FS_SESSION_BASE; offset += sizeof(buffer)) {
+		if ((uint16_t) (FS_SESSION_BASE - offset) < sizeof(buffer))
+			break;
+		// end of memory device
+		if (fs_read_block(buffer, offset, sizeof(buffer)))
+			break;
+		for (i = 0; i < sizeof(buffer); i++)
+			if (buffer[i] != 0xff)
+				break;
+		if (i != sizeof(buffer))
+			if (fs_write_ff(offset, sizeof(buffer)))
+				return;
+	}
+	fs_tree_pending(0xff);
+}
+
+void fs_tree_abort(void)
+{
+	DPRINT("%s\n", __FUNCTION__);
+
+	if (fs_tree.active) {
+		if (fs_tree.end != fs_tree.start)
+			fs_ff(fs_tree.start, fs_tree.end - fs_tree.start);
+		fs_tree_pending(0xff);
+	}
+	fs_tree.active = 0;
+}
+
+uint8_t fs_tree_begin(void)
+{
+	struct fs_response fr;
+
+	DPRINT("%s\n", __FUNCTION__);
+
+	fs_tree_abort();
+	if (fci_sel.fs.id == 0xffff)
+		return S0x6a82;	//file not found
+
+	memcpy(&fr, &fci_sel, sizeof(struct fs_response));
+	if (!is_DF(&fr))
+		if (RET_SEARCH_OK != fs_search_file(&fr, 0, NULL, S_PARENT))
+			return S0x6a82;
+	fs_tree.root = fs_tree.df = fr.fs.uuid;
+	fs_tree.root_acl = fs_tree.acl = fr.fs.acl[0];
+
+	// end of filesystem and new UUID (0xffff is never in collision)
+	if (RET_SEARCH_END != fs_search_file(&fr, 0xffff, NULL, S_MAX))
+		return S0x6581;	//memory fail
+
+	fs_tree.start = fs_tree.end = fr.mem_offset;
+	fs_tree.uuid = fr.fs.uuid;
+	fs_tree.data = 0;
+	fs_tree.depth = 0;
+	fs_tree.active = 1;
+	fs_tree_pending(0);
+	DPRINT("%s tree at %04x, UUID %04x\n", __FUNCTION__, fs_tree.start, fs_tree.uuid);
+	return S_RET_OK;
+}
+
+uint8_t fs_tree_add(uint8_t * data, uint16_t len)
+{
+	struct tlv t;
+	struct fs_data fs, tmp;
+	uint8_t *df_name;
+	uint8_t ret;
+
+	DPRINT("%s %d bytes\n", __FUNCTION__, len);
+
+	if (!fs_tree.active)
+		return S0x6985;	//condition not satisfied
+
+	ret = fs_tree_check(data, len);
+	if (ret != S_RET_OK)
+		return ret;
+
+	// this is long operation, start sending NULL
+	card_io_start_null();
+
+	// block is already checked, create files
+	tlv_init(&t, data, len);
+	while (tlv_next(&t) == TLV_OK) {
+		if (t.tag == TREE_TAG_UP) {
+			// current DF is created in this tree, get parent and ACL
+			if (RET_SEARCH_OK != fs_tree_search(NULL, NULL, &tmp))
+				return S0x6581;	//memory fail
+			fs_tree.df = tmp.parent_uuid;
+			fs_tree.depth--;
+			fs_tree.acl = fs_tree.root_acl;
+			if (fs_tree.depth) {
+				if (RET_SEARCH_OK != fs_tree_search(NULL, NULL, &tmp))
+					return S0x6581;	//memory fail
+				fs_tree.acl = tmp.acl[0];
+			}
+			fs_tree.data = 0;
+			continue;
+		}
+		if (t.tag == TREE_TAG_DATA) {
+			DPRINT("%s initial data %d bytes\n", __FUNCTION__, t.tag_len);
+			if (t.tag_len)
+				if (fs_write_block(t.value, fs_tree.data, t.tag_len))
+					return S0x6581;	//memory fail
+			fs_tree.data = 0;
+			continue;
+		}
+		memset(&fs, 0, sizeof(struct fs_data));
+		fs_parse_fcp(t.value, t.tag_len, &fs, &df_name);
+		fs.parent_uuid = fs_tree.df;
+		fs.uuid = fs_tree.uuid;
+		fs.active = 1;
+
+		if (check_security_pin_ac(fs.no_allocate ? fs_tree.acl & 0xf : fs_tree.acl >> 4))
+			return S0x6982;	//security status not satisfied
+
+		if (RET_SEARCH_END != fs_tree_search(&fs, df_name, &tmp))
+			return S0x6a89;	//already exists
+
+		DPRINT("%s file %04x UUID %04x at %04x\n", __FUNCTION__, fs.id, fs.uuid,
+		       fs_tree.end);
+		if (fs_tree.end == fs_tree.start)
+			memcpy(&fs_tree.first, &fs, sizeof(struct fs_data));
+		else if (fs_write_block(&fs, fs_tree.end, sizeof(struct fs_data)))
+			return S0x6581;	//memory fail
+		if (df_name)
+			if (fs_write_block
+			    (df_name + 1, fs_tree.end + sizeof(struct fs_data), *df_name))
+				return S0x6581;	//memory fail
+		fs_tree.uuid++;
+		if (fs.no_allocate) {
+			fs_tree.df = fs.uuid;
+			fs_tree.acl = fs.acl[0];
+			fs_tree.depth++;
+			fs_tree.data = 0;
+		} else {
+			fs_tree.data = fs_tree.end + sizeof(struct fs_data);
+		}
+		fs_tree.end = fs_next_offset(&fs, fs_tree.end);
+	}
+	return S_RET_OK;
+}
+
+uint8_t fs_tree_commit(void)
+{
+	DPRINT("%s\n", __FUNCTION__);
+
+	if (!fs_tree.active)
+		return S0x6985;	//condition not satisfied
+	fs_tree.active = 0;
+	if (fs_tree.end == fs_tree.start) {
+		fs_tree_pending(0xff);
+		return S_RET_OK;
+	}
+	if (fs_mark_end(fs_tree.end))
+		return S0x6581;	//memory fail
+	if (fs_write_block(&fs_tree.first, fs_tree.start, sizeof(struct fs_data)))
+		return S0x6581;	//memory fail
+	fs_tree_pending(0xff);
+	fs_journal_add(fs_tree.first.id, fs_tree.start);
+	return S_RET_OK;
+}
+
+uint8_t fs_create_file(uint8_t * buffer)
+{
+	struct fs_response fr1;
+	struct fs_data fs;
+	uint8_t xlen;
+	uint8_t *df_name;
+	uint8_t tag;
+	uint8_t dlen;
+	uint8_t ret;
+
+	DPRINT("%s\n", __FUNCTION__);
+
+	// free space is used, drop uncommitted file tree
+	fs_tree_abort();
+
+	if (fci_sel.fs.id == 0xffff)
+		return S0x6a82;	//file not found
+
+	// FCP too small ?
+	dlen = *(buffer++);
+	if (dlen < 2)
+		return S0x6984;	//invalid data
+
+	// test if FCP template is in buffer
+	tag = *(buffer++);
+	if (tag != 0x62)
+		return S0x6984;	//invalid data
+
+	// length of FCP template must match LC
+	// TODO this may fail for FCP over 127 bytes (len value in two bytes)
+	xlen = *(buffer++);
+	if (dlen - 2 != xlen)
+		return S0x6984;	//invalid data
+
+	memcpy(&fr1, &fci_sel, sizeof(struct fs_response));
+	// is already selected file DF ? if not, reselect to parent DF first
+	if (!is_DF(&fr1))
+		if (RET_SEARCH_OK != fs_search_file(&fr1, 0, NULL, S_PARENT))
+			return S0x6a82;
+
+	memset(&fs, 0, sizeof(struct fs_data));
+	fs.parent_uuid = fr1.fs.uuid;
+	fs.active = 1;
+
+	ret = fs_parse_fcp(buffer, xlen, &fs, &df_name);
+	if (ret != S_RET_OK)
+		return ret;
+
+	if (fs.no_allocate) {
 		if (check_DF_security(SEC_CREATE_DF))
 			return S0x6982;	//security status not satisfied
 		//all filenames must be different
@@ -1854,14 +2891,6 @@ uint8_t fs_create_file(uint8_t * buffer)
 			if (RET_SEARCH_OK == fs_search_file(&fr1, 0, df_name, S_NAME))
 				return S0x6a89;	//already exists
 	} else {
-		fs.no_allocate = 0;
-		// clear valid flag for key file (except 0x01 and 0x38 all file types are used for keys for now)
-		if (type != 1)
-			fs.prop &= 0xf0ff;
-		// EF does not have name
-		if (df_name)
-			return S0x6984;	//invalid data
-		// EF size can be specified by 0x80 or 0x81 tag
 		if (check_DF_security(SEC_CREATE_EF))
 			return S0x6982;	//security status not satisfied
 	}
@@ -1869,33 +2898,61 @@ uint8_t fs_create_file(uint8_t * buffer)
 	if (RET_SEARCH_END != fs_search_file(&fr1, fs.id, NULL, S_MAX))
 		return S0x6a89;	//already exists
 
+#ifdef FS_SESSION_SIZE
+	if (!fs.no_allocate && (fs.prop & FS_PROP_SESSION))
+		fr1.mem_offset = fs_session_end();
+#endif
 	DPRINT("%s filesystem position 0x%04x\n", __FUNCTION__, fr1.mem_offset);
 	fs.uuid = fr1.fs.uuid;
 
 	// there must be place for full file (+ 2 bytes for test  - FS end)
 	// because fs_search_file read "sizeof (struct fs_data)" bytes, check this value
-	if (0 !=
-	    device_read_block(&flag,
-			      fr1.mem_offset + sizeof(struct fs_data) +
-			      fs.name_size + fs.size + sizeof(struct fs_data), 1))
+	if (fs_no_space(fr1.mem_offset, sizeof(struct fs_data) + fs.name_size + fs.size))
 		return S0x6985;	//condition not satisfied
 
+	// free space may contain data from interrupted fs_tree_add()
+	if (fs_mark_end(fs_next_offset(&fs, fr1.mem_offset)))
+		return S0x6985;	//condition not satisfied
 	// save file header
-	if (device_write_block(&fs, fr1.mem_offset, sizeof(struct fs_data)))
+	if (fs_write_block(&fs, fr1.mem_offset, sizeof(struct fs_data)))
 		return S0x6985;	//condition not satisfied
 	// save filename if needed
 	if (df_name) {
 		DPRINT("%s FCI write OK, writing name\n", __FUNCTION__);
-		if (device_write_block
+		if (fs_write_block
 		    (df_name + 1, fr1.mem_offset + sizeof(struct fs_data), *df_name))
 			return S0x6985;	//condition not satisfied
 	}
+	fs_journal_add(fs.id, fr1.mem_offset);
 // select this file
 	if (fs_search_file(&fci_sel, fs.id, NULL, S_0))
 		return S0x6a82;
 	return S_RET_OK;	//all ok
 }
 
+// page - FS_INFO_MAX records per page
+uint8_t fs_list_files_info(uint8_t page, struct iso7816_response *r)
+{
+	struct fs_response fr;
+
+	DPRINT("%s page %d\n", __FUNCTION__, page);
+
+	if (fci_sel.fs.id == 0xffff)
+		return S0x6a82;	//file not found
+
+	memcpy(&fr, &fci_sel, sizeof(struct fs_response));
+	// select DF of current EF if needed
+	if (!is_DF(&fr))
+		if (RET_SEARCH_OK != fs_search_file(&fr, 0, NULL, S_PARENT))
+			return S0x6a82;
+
+	if (RET_SEARCH_END != fs_search_file(&fr, page * FS_INFO_MAX, r->data + 1, S_LIST_INFO))
+		return S0x6a82;	//file not found
+	// number of files on next pages
+	r->data[0] = fr.fs.size;
+	RESP_READY(1 + fr.fs.id * FS_INFO_LEN);
+}
+
 uint8_t fs_list_files(uint8_t type, struct iso7816_response *r)
 {
 	struct fs_response fr;
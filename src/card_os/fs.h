@@ -55,11 +55,27 @@ uint8_t fs_select_by_path_from_df (uint8_t * buffer,
 				    struct iso7816_response *r);
 
 
+#ifdef RSA_PRIME_POOL
+// pool of pregenerated RSA primes (in security memory)
+uint8_t fs_prime_pool_status (uint8_t * sizes, uint8_t size);
+uint8_t fs_prime_pool_check (void);
+uint8_t fs_prime_pool_put (uint8_t * prime, uint8_t size);
+uint8_t fs_prime_pool_get (uint8_t * prime, uint8_t size);
+#endif
+
 uint16_t fs_key_read_part (uint8_t * key, uint8_t type);
 
 // 1st byte = key type, 2nd key part size, rest key part
 uint8_t fs_key_write_part (uint8_t * key);
 
+// streamed write of key part (key[0] type, key[1] size), offset is set
+// in begin, key part is visible after commit
+uint8_t fs_key_part_begin (uint8_t * key, uint16_t * offset);
+uint8_t fs_key_part_write (uint16_t offset, uint8_t pos, uint8_t * data, uint8_t len);
+uint8_t fs_key_part_read (uint16_t offset, uint8_t pos, uint8_t * data, uint8_t len);
+uint8_t fs_key_part_commit (uint8_t * key, uint16_t offset);
+uint8_t fs_key_part_abort (uint8_t * key, uint16_t offset);
+
 uint8_t fs_read_binary (uint16_t offset, struct iso7816_response *r);
 uint8_t fs_update_binary (uint8_t * buffer, uint16_t offset);
 
@@ -68,7 +84,18 @@ uint8_t fs_erase_binary(uint16_t offset);
 uint8_t fs_delete_file (void);
 
 uint8_t fs_create_file (uint8_t * buffer);
+
+// bulk creation of file tree in current DF, data of fs_tree_add() must
+// contain whole TLVs (62 FCP, 53 EF content, 01 end of DF)
+uint8_t fs_tree_begin (void);
+uint8_t fs_tree_add (uint8_t * data, uint16_t len);
+uint8_t fs_tree_commit (void);
+void fs_tree_abort (void);
 uint8_t fs_list_files (uint8_t type, struct iso7816_response *r);
+// list of files in current DF with file info (FID, type, size, ACL, prop)
+uint8_t fs_list_files_info (uint8_t page, struct iso7816_response *r);
+// change counter and last changed files
+uint8_t fs_get_journal (struct iso7816_response *r);
 
 uint16_t fs_get_file_size (void);
 uint8_t fs_get_file_type (void);
@@ -43,6 +43,9 @@ indent -linux -l100
 #include <string.h>
 
 #include "rnd.h"
+#ifdef RND_POOL
+#include "aes.h"
+#endif
 #include "iso7816.h"
 #include "fs.h"
 #include "myeid_emu.h"
@@ -80,6 +83,11 @@ static void return_status(uint8_t status)
 {
 	// reuse P1,P2 as buffer for status (optionally for protocol T0 use INS as procedure byte)
 	uint8_t *message = iso_response.input + 2;
+	uint8_t *data;
+	uint8_t sw[2];
+#ifdef PROTOCOL_T0
+	uint8_t save[3];
+#endif
 	uint16_t Ne, Na;
 	uint16_t ret = 2;
 
@@ -108,6 +116,8 @@ static void return_status(uint8_t status)
 		iso_response.chaining_state = APDU_CHAIN_INACTIVE;
 		break;
 	case S0x6100:		// low byte - how many bytes are still available
+		// new response, data from start of buffer
+		iso_response.offset = 0;
 #ifdef PROTOCOL_T0
 		// if chaining is running drop already parsed APDU
 		iso_response.chain_len = 0;
@@ -134,31 +144,48 @@ static void return_status(uint8_t status)
 			Ne = 256;
 		if (Ne > Na)
 			Ne = Na;
-		memcpy(message, iso_response.data, Ne);
+		data = iso_response.data + iso_response.offset;
 		// calculate how many data is now in buffer
 		Na -= Ne;
 		if (Na == 0) {
 			//mark data already sended
-			message[Ne] = 0x90;
-			message[Ne + 1] = 0;
+			sw[0] = 0x90;
+			sw[1] = 0;
+			iso_response.offset = 0;
 		} else {
-			message[Ne] = 0x61;
+			sw[0] = 0x61;
 			if (Na <= 255)
-				message[Ne + 1] = Na;
+				sw[1] = Na;
 			else
-				message[Ne + 1] = 0;
-			memcpy(iso_response.data, iso_response.data + Ne, Na);
+				sw[1] = 0;
+			// rest of data is returned by next GET RESPONSE
+			iso_response.offset += Ne;
 		}
 		iso_response.len16 = Na;
 		DPRINT("sending response\n");
-		ret = Ne + 2;
 #ifdef PROTOCOL_T0
-// send response APDU (for protocol 0 prepend procedure byte "message" is pointer to P1..)
 		if (iso_response.protocol == 0) {
-			ret++;
-			message--;
+			// T0: send procedure byte, data and SW directly from response
+			// buffer, bytes around data are saved and restored after send
+			// (before data[0] is t0_pb, data[] is followed by input[])
+			save[0] = data[-1];
+			save[1] = data[Ne];
+			save[2] = data[Ne + 1];
+			data[-1] = message[-1];
+			data[Ne] = sw[0];
+			data[Ne + 1] = sw[1];
+			card_io_tx(data - 1, Ne + 3);
+			data[-1] = save[0];
+			data[Ne] = save[1];
+			data[Ne + 1] = save[2];
+			return;
 		}
 #endif
+		// T1 parser sends response later (chaining), copy response
+		memcpy(message, data, Ne);
+		message[Ne] = sw[0];
+		message[Ne + 1] = sw[1];
+		ret = Ne + 2;
 		break;
 
 		// for all other codes low byte defaults to 0x8X,
@@ -215,6 +242,70 @@ static uint8_t iso7816_verify(uint8_t * message, __attribute__((unused))
 	return fs_verify_pin(message + 3);
 }
 
+#ifdef RND_POOL
+/*
+GET CHALLENGE random pool
+
+rnd_get() collects 8 ADC conversions for each random byte, this is too slow
+for GET CHALLENGE.  Here AES-128 in counter mode (key and counter from
+rnd_get()) is used as DRBG.  Generator is seeded on first GET CHALLENGE (not
+in rnd_init(), ATR must not be delayed), for each GET CHALLENGE 2 bytes of
+fresh entropy are mixed into counter.  Unused bytes from last AES block are
+kept in pool for next GET CHALLENGE, after each GET CHALLENGE AES key is
+replaced by next DRBG output (previous challenges can not be calculated
+from actual state).
+*/
+static struct {
+	uint8_t key[16];
+	uint8_t ctr[16];
+	uint8_t pool[16];
+	uint8_t avail;
+	uint8_t seeded;
+} rnd_pool;
+
+static void rnd_pool_block(uint8_t * block)
+{
+	uint8_t i;
+
+	memcpy(block, rnd_pool.ctr, 16);
+	aes_run(block, rnd_pool.key, 16, 0);
+	for (i = 0; i < 16; i++)
+		if (++rnd_pool.ctr[i])
+			break;
+}
+
+static void rnd_pool_get(uint8_t * r, uint8_t size)
+{
+	uint8_t key[16];
+	uint8_t *p;
+	uint8_t e[2];
+
+	if (!rnd_pool.seeded) {
+		rnd_get(rnd_pool.key, 16);
+		rnd_get(rnd_pool.ctr, 16);
+		rnd_pool.seeded = 1;
+	}
+	// mix fresh entropy into counter (do not overwrite the counter)
+	rnd_get(e, 2);
+	rnd_pool.ctr[0] ^= e[0];
+	rnd_pool.ctr[1] ^= e[1];
+
+	while (size--) {
+		if (!rnd_pool.avail) {
+			rnd_pool_block(rnd_pool.pool);
+			rnd_pool.avail = 16;
+		}
+		p = rnd_pool.pool + (--rnd_pool.avail);
+		*r++ = *p;
+		*p = 0;
+	}
+	// key update
+	rnd_pool_block(key);
+	memcpy(rnd_pool.key, key, 16);
+	memset(key, 0, 16);
+}
+#endif
+
 static uint8_t iso7816_get_challenge(uint8_t * message, struct iso7816_response *r)
 {
 	uint8_t rlen;
@@ -229,7 +320,11 @@ static uint8_t iso7816_get_challenge(uint8_t * message, struct iso7816_response
 	rlen = r->Ne & 0xff;
 	if (rlen == 0)
 		return S0x6f00;	//no particular diagnostic (same response as from MyEID 3.3.3)
+#ifdef RND_POOL
+	rnd_pool_get(r->data, rlen);
+#else
 	rnd_get(r->data, rlen);
+#endif
 	r->len16 = rlen;
 	return S0x6100;
 }
@@ -922,6 +1017,7 @@ void card_poll(void)
 void response_clear(void)
 {
 	iso_response.len16 = 0;
+	iso_response.offset = 0;
 	// clear chaining, chain_len is cleared insipe APDU parsing code
 	iso_response.chaining_state = APDU_CHAIN_INACTIVE;
 #ifdef PROTOCOL_T0
@@ -48,6 +48,8 @@ struct iso7816_response
   uint16_t len16;
   uint16_t tmp_len;		// length of chained APDU (except last APDU part)
   uint16_t chain_len;		// length of chained APDU (whole collected data)
+  uint16_t offset;		// position of not yet returned data in data[] (GET RESPONSE)
+  uint8_t t0_pb;		// T0 procedure byte, sent from here if offset is 0 (must be before data)
   uint8_t data[APDU_RESP_LEN];
   uint8_t input[APDU_CMD_LEN];
 };
@@ -101,6 +103,7 @@ struct iso7816_response
 #define S0x6a80 0xa0
 #define S0x6a81 0xa1
 #define S0x6a82 0xa2
+#define S0x6a84 0xa4
 #define S0x6a86 0xa6
 #define S0x6a87 0xa7
 #define S0x6a88 0xa8
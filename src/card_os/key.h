@@ -56,6 +56,20 @@
 #define KEY_RSA_EXP_p1	0x8a
 #define KEY_RSA_EXP_p2	0x8b
 
+// not a key part, PUT DATA only: public exponent, calculate dP, dQ, qInv
+#define KEY_RSA_DERIVE	0x8c
+
+#ifdef RSA_MULTI_PRIME
+// three prime key, 3rd prime, exponent and CRT coefficient (p*q)^-1 mod r
+#define KEY_RSA_r	0x8d
+#define KEY_RSA_dR	0x8e
+#define KEY_RSA_tR	0x8f
+// primes (n_ and Barrett constant is calculated for these parts)
+#define KEY_RSA_PRIME(type) ((type) == KEY_RSA_p || (type) == KEY_RSA_q || (type) == KEY_RSA_r)
+#else
+#define KEY_RSA_PRIME(type) ((type) == KEY_RSA_p || (type) == KEY_RSA_q)
+#endif
+
 
 //AES, DES - not used, 0xa0 comes from APDU directly
 #define KEY_AES_DES  0xa0
@@ -56,6 +56,7 @@ indent -linux -l100
 #include "constants.h"
 #include "bn_lib.h"
 #include "mem_device.h"
+#include "tlv.h"
 
 #define M_CLASS message[0]
 #define M_CMD message[1]
@@ -154,6 +155,8 @@ static uint8_t check_ec_key_file(uint16_t size, uint8_t type)
 		if (size == 192)
 			return 0;
 #if MP_BYTES >= 32
+		if (size == 224)
+			return 0;
 		if (size == 256)
 			return 0;
 #endif
@@ -170,7 +173,9 @@ static uint8_t check_ec_key_file(uint16_t size, uint8_t type)
 }
 
 #ifdef USE_P_Q_INV
-static uint8_t key_preproces(uint8_t * kpart, uint8_t m_size)
+// calculate n_ and Barrett constant for p/q (type 0x83/0x84), kpart in
+// little endian, buffer must allow read RSA_BYTES
+static uint8_t key_constants(uint8_t type, uint8_t * kpart, uint8_t m_size)
 {
 	struct {
 		uint8_t type;
@@ -183,17 +188,13 @@ static uint8_t key_preproces(uint8_t * kpart, uint8_t m_size)
 
 	uint16_t ret;
 
-	ret = fs_key_write_part(kpart);
-	if (ret != S_RET_OK)
-		return ret;
-
 	DPRINT("calculating inverse of p/q size=%d\n", m_size);
 
 	m_size = bn_set_bitlen(m_size * 8);
-	tmp.type = 0x20 | kpart[0];
+	tmp.type = 0x20 | type;
 	tmp.size = m_size / 2;
 
-	rsa_inv_mod_N(&tmp.hn, (rsa_num *) (kpart + 2));
+	rsa_inv_mod_N(&tmp.hn, (rsa_num *) kpart);
 
 	ret = fs_key_write_part(&tmp.type);
 	if (ret != S_RET_OK)
@@ -201,9 +202,20 @@ static uint8_t key_preproces(uint8_t * kpart, uint8_t m_size)
 
 	tmp.type |= 0x30;
 	tmp.size = m_size;
-	barrett_constant(&tmp.t1, (rsa_num *) (kpart + 2));
+	barrett_constant(&tmp.t1, (rsa_num *) kpart);
 	return fs_key_write_part(&tmp.type);
 }
+
+static uint8_t key_preproces(uint8_t * kpart, uint8_t m_size)
+{
+	uint16_t ret;
+
+	ret = fs_key_write_part(kpart);
+	if (ret != S_RET_OK)
+		return ret;
+
+	return key_constants(kpart[0], kpart + 2, m_size);
+}
 #endif
 
 static uint8_t check_rsa_key_size(uint16_t size)
@@ -237,6 +249,19 @@ uint8_t get_rsa_key_part(void *here, uint8_t id)
 	return part_size;
 }
 
+// size of RSA modulus in bytes (0 if there is no key in selected file)
+static uint16_t rsa_modulus_size(void)
+{
+	uint16_t size = fs_key_read_part(NULL, KEY_RSA_p);
+
+#ifdef RSA_MULTI_PRIME
+	// three prime key, modulus size from key file size
+	if (size && fs_key_read_part(NULL, KEY_RSA_r))
+		return fs_get_file_size() / 8;
+#endif
+	return size * 2;
+}
+
 // do sign/decrypt with selected key, return 0 if error,
 // or len of returned message (based on key size).
 // input length of message, message, result after sign/decrypt
@@ -258,8 +283,7 @@ static uint16_t rsa_raw(uint16_t len, uint8_t * message, uint8_t * result, uint8
 	HPRINT("reversed mesage =\n", message, RSA_BYTES * 2);
 
 	// test if key match data size
-	part_size = fs_key_read_part(NULL, KEY_RSA_p);
-	part_size *= 2;		// calculate message size
+	part_size = rsa_modulus_size();	// calculate message size
 
 	DPRINT("key modulus: %d, message len: %d flag: %d\n", part_size, len, flag);
 	if (flag == 0) {
@@ -326,7 +350,7 @@ static uint16_t rsa_raw(uint16_t len, uint8_t * message, uint8_t * result, uint8
 // Special values of A (A=0, A=-3) are indicated in the c->curve_type
 // (A and B is needed for ECDH operation to check if point is on curve)
 
-// size 24/32/48 for ecc 192,256/384 bis, id 0 get key from selected file and use
+// size 24/28/32/48/66 for ecc 192,224,256,384,521 bits, id 0 get key from selected file and use
 // key size to setup ec parameters
 static uint8_t prepare_ec_param(struct ec_param *c, ec_point_t * p, uint8_t size)
 {
@@ -336,7 +360,7 @@ static uint8_t prepare_ec_param(struct ec_param *c, ec_point_t * p, uint8_t size
 	memset(c, 0, sizeof(struct ec_param));
 
 	// ACL and file existence is checked in fs_key_read, return value can be used to select
-	// 192/256/384 key algo
+	// 192/224/256/384/521 key algo
 
 	if (size == 0) {
 		ret = fs_key_read_part(NULL, KEY_EC_PRIVATE);
@@ -359,6 +383,9 @@ static uint8_t prepare_ec_param(struct ec_param *c, ec_point_t * p, uint8_t size
 			var_C = C_P192V1 | C_P192V1_MASK;
 		}
 #if MP_BYTES >= 32
+		else if (ret == 28) {
+			var_C = C_SECP224R1 | C_SECP224R1_MASK;
+		}
 		else if (ret == 32) {
 			var_C = C_P256V1 | C_P256V1_MASK;
 		}
@@ -479,7 +506,7 @@ static uint8_t sign_ec_raw(uint8_t * message, struct iso7816_response *r, uint16
 // 0x30, 0x81,LEN , 2,0,R[61],2,0,S[61]  = 129
 
 // for LEN = 126 / 127  LEN is coded as 0x81 0x7e / 0x81 0x7f correct coding is 0x7e / 0x7f
-// This simplification is no problem for OsEID, here only  24,32,48, or 66 bytes are used
+// This simplification is no problem for OsEID, here only  24,28,32,48, or 66 bytes are used
 
 	r->data[0] = 0x30;
 	skip0 = 2;
@@ -504,10 +531,11 @@ static uint8_t sign_ec_raw(uint8_t * message, struct iso7816_response *r, uint16
 uint8_t security_env_set_reset(uint8_t * message, __attribute__((unused))
 			       struct iso7816_response *r)
 {
+	struct tlv crdo;
 	uint16_t tagval;
-	uint8_t xlen, *data;;
-	uint8_t tag;
-	uint8_t taglen;
+	uint8_t *data;
+	uint16_t taglen;
+	uint8_t ret;
 	uint8_t s_env = 0;
 
 // invalidate sec env
@@ -655,25 +683,16 @@ AES/DES  tag 0x80, value 0x80 - pkcs#7 padding
 		return S0x6a81;	//Function not supported // change to wrong arg ?
 
 	// Empty or concatenation of Control Reference Data Objects (CRDO)
-	xlen = M_P3;
-	data = message + 5;
-	for (;;) {
-		if (!(xlen--))
-			break;
-		tag = *(data++);
-		if (tag == 0 || tag == 0xff)
-			continue;
-		if (!(xlen--))
-			break;
-		taglen = *(data++);
+	tlv_init(&crdo, message + 5, M_P3);
+	while ((ret = tlv_next(&crdo)) == TLV_OK) {
+		data = crdo.value;
+		taglen = crdo.tag_len;
 		if (taglen > 16)
 			return S0x6984;	//maximal tag size is 16 (init vector)
-		if (xlen < taglen)	// not enough data in buffer (to match taglen)
-			return S0x6984;	//invalid data
 		tagval = *data;
 		if (taglen == 2)
 			tagval = (tagval << 8) | *(data + 1);
-		switch (tag) {
+		switch (crdo.tag) {
 		case 0x80:
 			if (taglen != 1)
 				return S0x6a81;	//Function not supported      // change to wrong arg ?
@@ -733,9 +752,9 @@ AES/DES  tag 0x80, value 0x80 - pkcs#7 padding
 		default:
 			return S0x6a80;	// incorrect parameters in the data field / wrong data
 		}
-		xlen -= taglen;
-		data += taglen;
 	}
+	if (ret == TLV_ERROR)
+		return S0x6984;	//invalid data
 	// minimum template - reference algo and file
 	if ((s_env & (SENV_FILE_REF | SENV_REF_ALGO))
 	    != (SENV_FILE_REF | SENV_REF_ALGO)) {
@@ -871,6 +890,9 @@ static uint8_t des_aes_cipher(struct iso7816_response *r, uint8_t mode)
 	uint8_t *p = r->data;
 	uint8_t *data = r->input;
 	uint16_t size = r->Nc;
+#ifdef AES_CTX
+	struct aes_ctx ctx;
+#endif
 
 	DPRINT("%s mode %s chain state %d\n", __FUNCTION__,
 	       mode ? "decipher" : "encipher", r->chaining_state);
@@ -950,6 +972,11 @@ static uint8_t des_aes_cipher(struct iso7816_response *r, uint8_t mode)
 	if (padd_len)
 		return S0x6700;	//Incorrect length
 
+#ifdef AES_CTX
+	// SBOX and key expansion only once for all blocks
+	if (type == AES_KEY_EF)
+		aes_init_ctx(&ctx, data, ksize);
+#endif
 	for (offset = size; offset; offset -= bsize, p += bsize) {
 		if (mode == 0)
 			apply_iv(p);
@@ -957,7 +984,11 @@ static uint8_t des_aes_cipher(struct iso7816_response *r, uint8_t mode)
 			memcpy(iv, p, bsize);
 
 		if (type == AES_KEY_EF)
+#ifdef AES_CTX
+			aes_run_ctx(&ctx, p, mode);
+#else
 			aes_run(p, data, ksize, mode);
+#endif
 		else
 			des_run(p, data, flag);
 
@@ -968,6 +999,9 @@ static uint8_t des_aes_cipher(struct iso7816_response *r, uint8_t mode)
 			memcpy(i_vector_tmp, iv, bsize);
 		}
 	}
+#ifdef AES_CTX
+	memset(&ctx, 0, sizeof(ctx));
+#endif
 
 // pkcs#7 padding remove
 	if (mode != 0 && last_block_padding) {
@@ -1153,6 +1187,51 @@ static uint8_t security_operation_encrypt(struct iso7816_response *r)
 	return des_aes_cipher(r, 0);
 }
 
+// UNWRAP: decrypted key (r->data, r->len16 bytes) is stored directly into
+// target file (key file or generic secret EF, session object is stored in
+// RAM), plain key is never returned
+static uint8_t unwrap_to_target(struct iso7816_response *r)
+{
+	uint16_t size = r->len16;
+	uint16_t k_size;
+	uint8_t ret;
+
+	DPRINT("storing decrypted data (%d bytes) to target file\n", size);
+
+	fs_select_uuid(target_file_uuid, NULL);
+	k_size = fs_get_file_size();
+
+	// TAG, LEN in front of key data (one write for whole key part)
+	memmove(r->data + 2, r->data, size);
+	r->data[0] = KEY_AES_DES;
+	r->data[1] = size;
+	switch (fs_get_file_type()) {
+	case DES_KEY_EF:
+	case AES_KEY_EF:
+		if (size * 8 != k_size) {
+			DPRINT("key size %d, key file size %d bits\n", size, k_size);
+			ret = S0x6700;	// wrong length
+			break;
+		}
+		ret = fs_key_write_part(r->data);
+		break;
+	case 0x41:
+		// fs_update_binary() uses one byte for length
+		if (size > 255) {
+			ret = S0x6700;	// wrong length
+			break;
+		}
+		ret = fs_update_binary(r->data + 1, 0);
+		break;
+	default:
+		ret = S0x6981;	// incorrect file type
+	}
+	// clear plain key
+	memset(r->data, 0, size + 2);
+	r->len16 = 0;
+	return ret;
+}
+
 static uint8_t security_operation_decrypt(struct iso7816_response *r)
 {
 	uint8_t ret;
@@ -1169,35 +1248,10 @@ static uint8_t security_operation_decrypt(struct iso7816_response *r)
 	if (!r->Nc)
 		return S0x6700;
 	ret = decipher(r);
-	// for Unwrap operation write data to file
+	// for Unwrap operation write data to file, do not return data
 	if (ret == S0x6100 && sec_env_valid & SENV_TARGET_ID
-	    && (!(r->chaining_state & APDU_CHAIN_RUNNING))) {
-		uint8_t type;
-		uint8_t *keydata;
-
-		DPRINT("storing decrypted data to target file\n");
-
-		fs_select_uuid(target_file_uuid, NULL);
-		type = fs_get_file_type();
-		// TODO better checking of key sizes  etc...
-		if ((type == 0x41 || type == DES_KEY_EF || type == AES_KEY_EF)
-		    && r->len16 < 254) {
-			memcpy(r->input + 5, r->data, r->len16);
-			// copy data, experimental, how is stored data in original MyEID card?
-			keydata = r->input + 3;
-			keydata[0] = 0xa0;	// TAG
-			keydata[1] = r->len16 & 0xff;	// LEN
-
-			HPRINT("data for file: \n", keydata, r->len16 + 2);
-
-			// TODO error checking
-			if (type == 0x41)
-				fs_update_binary(keydata + 1, 0);	// do not store TAG, LEN
-			else
-				fs_key_write_part(keydata);
-		} else
-			ret = S0x6985;	//    Conditions not satisfied
-	}
+	    && (!(r->chaining_state & APDU_CHAIN_RUNNING)))
+		ret = unwrap_to_target(r);
 	return ret;
 }
 
@@ -1220,6 +1274,84 @@ static void select_back_and_deauth(uint16_t uuid)
 	fs_select_uuid(uuid, NULL);	// select back old file
 }
 
+// OsEID proprietary, P1 = 1: template may contain more points (tag 0x85),
+// all points are derived with the same key (EC parameters, key and ACL are
+// handled once), results are concatenated in order of points.  Each APDU
+// of chain is processed separately and returns results for own points,
+// the key is deauthenticated after each APDU (a chain can be terminated
+// by any other APDU, deauthentication at chain end is not guaranteed).
+
+// Result (X, key size) is shorter than point TLV, result is stored into
+// already parsed part of APDU data.
+static __attribute__((noinline))
+uint8_t myeid_ecdh_derive_batch(uint8_t * message, struct iso7816_response *r)
+{
+#if MP_BYTES > 48
+	struct ec_param *ec = alloca(sizeof(struct ec_param));
+#else
+	// reuse result buffer for ec_param structure, points are in message
+	struct ec_param *ec = (struct ec_param *)r->data;
+#endif
+	ec_point_t *derived_key = alloca(sizeof(ec_point_t));
+	uint8_t *result = message + 5;
+	uint8_t size, ret = TLV_OK, sw = S_RET_OK;
+	uint16_t len = 0;
+	struct tlv t, tmpl;
+	uint16_t uuid;
+
+	DPRINT("%s\n", __FUNCTION__);
+
+	tlv_init(&t, message + 5, M_P3);
+	if (tlv_expect(&t, 0x7c) == 0xffff)
+		return S0x6984;	// Invalid data
+	tlv_enter(&tmpl, &t);
+	if (tlv_next(&t) != TLV_END)
+		return S0x6984;	// Invalid data
+
+	// prepare Ec constant, use size based on key  (key from selected file)
+	size = prepare_ec_param(ec, NULL, 0);
+	if (size == 0) {
+		DPRINT("Error, unable to get EC parameters/key\n");
+		return S0x6985;	//    Conditions not satisfied
+	}
+	uuid = fs_get_selected_uuid();	// save old selected file
+	fs_select_uuid(key_file_uuid, NULL);
+	// this is  long operation, start sending NULL
+	card_io_start_null();
+
+	while (sw == S_RET_OK && (ret = tlv_next(&tmpl)) == TLV_OK) {
+		if (tmpl.tag == 0x80)
+			continue;
+		// uncompressed point, coordinates of key size
+		if (tmpl.tag != 0x85 || tmpl.tag_len != 2 * size + 1 || *tmpl.value != 0x04) {
+			sw = S0x6984;	// Invalid data
+			break;
+		}
+		memset(derived_key, 0, sizeof(ec_point_t));
+		reverse_copy((uint8_t *) & (derived_key->X), tmpl.value + 1, size);
+		reverse_copy((uint8_t *) & (derived_key->Y), tmpl.value + 1 + size, size);
+
+		if (ec_derive_key(derived_key, ec))
+			sw = S0x6985;	//    Conditions not satisfied
+		else
+			reverse_copy(result + len, (uint8_t *) derived_key, size);
+		len += size;
+	}
+	if (ret == TLV_ERROR || len == 0)
+		sw = S0x6984;	// Invalid data
+	memset(&ec->working_key, 0, sizeof(bignum_t));
+
+	select_back_and_deauth(uuid);
+
+	if (sw != S_RET_OK) {
+		memset(result, 0, len);
+		return sw;
+	}
+	memcpy(r->data, result, len);
+	memset(result, 0, len);
+	RESP_READY(len);
+}
+
 //APDU: 00 86 00 00 35
 // Dynamic auth template:
 // (tag)7C (ASN1 coded len)33
@@ -1229,9 +1361,9 @@ static void select_back_and_deauth(uint16_t uuid)
 //    47 57 75 41 68 74 24 FE B1 55 55 27 06 52 90 2D 62 84 B5 C2 FF 1B 12 9E
 //    CD EE D7 47 58 FB 45 F1 E8 8B 72 E3 C7 9E 80 F0 CC 3D 18 D7 4C 05 CD 31
 
-// here r->data is used as input and point for ecdh
-// in first part (0..109) = data for exdh operation (copied from message)
-// rest 110-254 ec_point_t
+// APDU data are parsed in place, point is copied to derived_key before
+// message buffer is reused as ec_param structure (for MP_BYTES <= 48)
+// r->data 110-254 ec_point_t
 
 #define L_ECDH_OFFSET 110
 uint8_t myeid_ecdh_derive(uint8_t * message, struct iso7816_response *r)
@@ -1239,7 +1371,6 @@ uint8_t myeid_ecdh_derive(uint8_t * message, struct iso7816_response *r)
 #if MP_BYTES > 48
 	struct ec_param *ec = alloca(sizeof(struct ec_param));
 	ec_point_t *derived_key = alloca(sizeof(ec_point_t));
-	memset(derived_key, 0, sizeof(ec_point_t));
 #else
 	// reuse result buffer for ec_param structure
 	struct ec_param *ec = (struct ec_param *)message;
@@ -1247,13 +1378,14 @@ uint8_t myeid_ecdh_derive(uint8_t * message, struct iso7816_response *r)
 #endif
 
 	uint8_t ret, dret;
-	uint8_t t_len, *t;
-	uint8_t tg, tl;
+	struct tlv t, tmpl;
+	uint8_t *point = NULL;
+	uint16_t point_len = 0;
 	uint16_t uuid;
 
 	DPRINT("%s %02x %02x\n", __FUNCTION__, M_P1, M_P2);
 
-	if (M_P1 != 0 || M_P2 != 0)
+	if (M_P1 > 1 || M_P2 != 0)
 		return S0x6a86;	//Incorrect parameters P1-P2
 
 // is security enviroment set to derive ?
@@ -1261,85 +1393,50 @@ uint8_t myeid_ecdh_derive(uint8_t * message, struct iso7816_response *r)
 		DPRINT("invalid sec env\n");
 		return S0x6985;	//    Conditions not satisfied
 	}
-// security operation always need data
-	if (M_P3 == 0)
-		return S0x6984;	//invalid data
-#if  MP_BYTES <= 48
-	if (M_P3 > L_ECDH_OFFSET)
-		return S0x6700;	//Incorrect length
-#endif
-
-// check minimal LC: 0x7c LEN TAG ..  or 0x7x 0x81 LEN
-	if (M_P3 < 3)
-		return S0x6984;	// Invalid data
-
-	t = r->data;
-// message is reused as ec_param structure (for MP_BYTES <= 48)
-	memcpy(t, message + 5, M_P3);
-
-	uint8_t dlen = M_P3;
-// check rest of APDU
-	if (*t++ != 0x7c)	// Dynamic autentification template
+	if (M_P1 == 1)
+		return myeid_ecdh_derive_batch(message, r);
+// Dynamic autentification template, nothing after template
+	tlv_init(&t, message + 5, M_P3);
+	if (tlv_expect(&t, 0x7c) == 0xffff)
 		return S0x6984;	// Invalid data
-
-// parse ASN1 LEN value (0-255)
-	t_len = *t++;
-	if (t_len & 0x80) {
-		dlen--;
-		if (t_len != 0x81)
-			return S0x6984;	// Invalid data (ASN1 length > 255)
-		t_len = *t++;
-	}
-
-	if (t_len != dlen - 2)	// check length of template
+	tlv_enter(&tmpl, &t);
+	if (tlv_next(&t) != TLV_END)
 		return S0x6984;	// Invalid data
 
-	while (t_len > 1) {
-		tg = *t++;
-		// parse ASN1 LEN value (0-255)
-		tl = *t++;
-		if (tl & 0x80) {
-			t_len--;
-			if (tl != 0x81)
-				return S0x6984;	// Invalid data (ASN1 length >255)
-			tl = *t++;
-		}
-		t_len -= 2;
-
-		if (t_len < tl) {
-			DPRINT("Wrong length of tag  %02x lenght %d (in buffer only %d)\n",
-			       tg, tl, t_len);
-			return S0x6984;	// Invalid data
-		}
-		if (tg == 0x85) {
-			if (*t++ != 0x04)	// unexpanded point indicator
+	while ((ret = tlv_next(&tmpl)) == TLV_OK) {
+		if (tmpl.tag == 0x85) {
+			// unexpanded point indicator
+			if (tmpl.tag_len < 1 || *tmpl.value != 0x04)
 				return S0x6984;	// Invalid data
-			if (tl != t_len)
-				return S0x6984;	// Invalid data
-			t_len--;
-			break;
-		} else if (tg == 0x80) {
-			t += tl;
-			t_len -= tl;
-		} else {
-			DPRINT("Unknown tag %02x\n", tg);
+			point = tmpl.value + 1;
+			point_len = tmpl.tag_len - 1;
+		} else if (tmpl.tag != 0x80) {
+			DPRINT("Unknown tag %02x\n", tmpl.tag);
 			return S0x6984;	// Invalid data
 		}
 	}
+	if (ret == TLV_ERROR || !point)
+		return S0x6984;	// Invalid data
+	if ((point_len & 1) || point_len > 2 * MP_BYTES)
+		return S0x6984;	// Invalid data
+
+	memset(derived_key, 0, sizeof(ec_point_t));
+	point_len /= 2;
+	reverse_copy((uint8_t *) & (derived_key->X), point, point_len);
+	reverse_copy((uint8_t *) & (derived_key->Y), point + point_len, point_len);
+
 	// prepare Ec constant, use size based on key  (key from selected file)
 	ret = prepare_ec_param(ec, NULL, 0);
 	if (ret == 0) {
 		DPRINT("Error, unable to get EC parameters/key\n");
 		return S0x6985;	//    Conditions not satisfied
 	}
-	if (ret * 2 != t_len) {
+	if (ret != point_len) {
 		DPRINT
 		    ("Incorrect length of point data %d, selected file need %d bytes\n",
-		     t_len, ret * 2);
+		     point_len * 2, ret * 2);
 		return S0x6984;	// Invalid data
 	}
-	reverse_copy((uint8_t *) & (derived_key->X), t, ec->mp_size);
-	reverse_copy((uint8_t *) & (derived_key->Y), t + ret, ec->mp_size);
 
 	uuid = fs_get_selected_uuid();	// save old selected file
 	fs_select_uuid(key_file_uuid, NULL);
@@ -1414,12 +1511,102 @@ DECIPHER:  00 84 || 80 84 || 00 86 || 80 86
 	return ret;
 }
 
+#ifdef RSA_MULTI_PRIME
+// three prime key, P, Q and R are not of same size (see RSA_MP_R_PART)
+static __attribute__((noinline))
+uint8_t myeid_generate_rsa_mp_key(uint8_t * message, struct iso7816_response *r, uint16_t k_size)
+{
+	struct rsa_crt_key key;
+	struct rsa_mp_key mp;
+	rsa_num *part;
+	uint16_t err;
+	uint8_t size, r_size, i;
+
+	// smallest prime must not be much shorter than 1/3 of modulus
+	if (k_size < RSA_MP_MIN_BITS)
+		return S0x6a86;	//Incorrect parameters P1-P2
+
+	card_io_start_null();
+	// return: dP, dQ, qInv       in struct rsa_crt_key
+	//         R, dR, tR          in struct rsa_mp_key
+	//         P,Q                in message
+	//         modulus            in r->data
+	size = rsa_keygen_mp(message + 4, r->data, &key, &mp, k_size);
+	r_size = RSA_MP_R_PART(k_size / 8);
+
+	message[2] = KEY_RSA_p | KEY_GENERATE;
+	message[3] = size;
+	message[128 + 2] = KEY_RSA_q | KEY_GENERATE;
+	message[128 + 3] = size;
+#ifndef USE_P_Q_INV
+	err = fs_key_write_part(message + 2);
+	if (err == S_RET_OK)
+		err = fs_key_write_part(message + 128 + 2);
+#else
+	err = key_preproces(message + 2, size);
+	if (err == S_RET_OK)
+		err = key_preproces(message + 128 + 2, size);
+#endif
+	// dP, dQ, qInv and dR, tR are consecutive in structures
+	part = &key.dP;
+	for (i = KEY_RSA_dP; err == S_RET_OK && i <= KEY_RSA_qInv; i++, part++) {
+		message[2] = i | KEY_GENERATE;
+		memcpy(message + 4, part, size);
+		err = fs_key_write_part(message + 2);
+	}
+	message[2] = KEY_RSA_r | KEY_GENERATE;
+	message[3] = r_size;
+	memcpy(message + 4, &mp.r, r_size);
+#ifndef USE_P_Q_INV
+	if (err == S_RET_OK)
+		err = fs_key_write_part(message + 2);
+#else
+	if (err == S_RET_OK)
+		err = key_preproces(message + 2, r_size);
+#endif
+	part = &mp.dR;
+	for (i = KEY_RSA_dR; err == S_RET_OK && i <= KEY_RSA_tR; i++, part++) {
+		message[2] = i | KEY_GENERATE;
+		memcpy(message + 4, part, r_size);
+		err = fs_key_write_part(message + 2);
+	}
+	memset(&key, 0, sizeof(key));
+	memset(&mp, 0, sizeof(mp));
+	memset(message, 0, 128 + 4 + size);
+	if (err != S_RET_OK) {
+		DPRINT("Unable to write three prime key part\n");
+		return err;
+	}
+	// Fixed public exponent 65537
+	message[2] = KEY_RSA_EXP_PUB;
+	message[3] = 3;
+	message[4] = 1;
+	message[5] = 0;
+	message[6] = 1;
+	err = fs_key_write_part(message + 2);
+	if (err != S_RET_OK) {
+		DPRINT("Unable to write public exponent to file\n");
+		return err;
+	}
+	// return plain modulus (same as for two prime key)
+	reverse_string(r->data, k_size / 8);
+	RESP_READY(k_size / 8);
+}
+#endif
+
 static __attribute__((noinline))
 uint8_t myeid_generate_rsa_key(uint8_t * message, struct iso7816_response *r)
 {
 	uint16_t k_size;
 	uint16_t ret, err;
 	struct rsa_crt_key key;
+	struct tlv t, exp;
+	uint8_t *e;
+	uint16_t e_len;
+	uint8_t pool = 0;
+#ifdef RSA_PRIME_POOL
+	uint8_t sizes[RSA_PRIME_POOL];
+#endif
 // check user suplied data (if any)
 	if (M_P3) {
 
@@ -1430,28 +1617,27 @@ uint8_t myeid_generate_rsa_key(uint8_t * message, struct iso7816_response *r)
 		// 0x30 0x05 0x02 0x03 0x01 0x00 0x01 - public exponent = 65537
 		//           ^^^^ is public exponent tag, but opensc uses 0x81 here
 
-// lot of stupid tests .. TODO do normal ASN parsing
-		if (M_P3 != 7)
-			return S0x6984;	//invalid data
-		if (message[5] != 0x30)
+		tlv_init(&t, message + 5, M_P3);
+		if (tlv_expect(&t, 0x30) == 0xffff)
 			return S0x6984;	//invalid data
-
-// Workaround ..
-		if (message[7] != 0x81 && message[7] != 2)
-			return S0x6984;	//invalid data
-
-// allow only matching lengths..
-		if (message[6] != 5)
+		tlv_enter(&exp, &t);
+		if (tlv_next(&t) != TLV_END)
 			return S0x6984;	//invalid data
-// test for 65537 ..
-		if (message[8] != 3)
+		if (tlv_next(&exp) != TLV_OK)
 			return S0x6984;	//invalid data
-
-		if (message[9] != 1)
+// Workaround ..
+		if (exp.tag != 0x81 && exp.tag != 2)
 			return S0x6984;	//invalid data
-		if (message[10] != 0)
+		if (tlv_next(&exp) != TLV_END)
 			return S0x6984;	//invalid data
-		if (message[11] != 1)
+// allow leading zeros, test for 65537 ..
+		e = exp.value;
+		e_len = exp.tag_len;
+		while (e_len && *e == 0) {
+			e++;
+			e_len--;
+		}
+		if (e_len != 3 || e[0] != 1 || e[1] != 0 || e[2] != 1)
 			return S0x6984;	//invalid data
 	}
 // user data are checked to public exponent 65537, even user does not specify
@@ -1462,11 +1648,24 @@ uint8_t myeid_generate_rsa_key(uint8_t * message, struct iso7816_response *r)
 	if (check_rsa_key_size(k_size))
 		return S0x6981;	//icorrect file type
 
+#ifdef RSA_MULTI_PRIME
+	if (M_P1 == 3)
+		return myeid_generate_rsa_mp_key(message, r, k_size);
+#endif
 	card_io_start_null();
+#ifdef RSA_PRIME_POOL
+	// use two primes from pool (if available)
+	if (fs_prime_pool_status(sizes, k_size / 16) >= 2) {
+		memset(message + 4, 0, RSA_BYTES * 2);
+		fs_prime_pool_get(message + 4, k_size / 16);
+		fs_prime_pool_get(message + 128 + 4, k_size / 16);
+		pool = 1;
+	}
+#endif
 	// return: dP, dQ, qInv and d in  struct rsa_crt_key
 	//         P,Q                in message
 	//         modulus            in r->data
-	ret = rsa_keygen(message + 4, r->data, &key, k_size);
+	ret = rsa_keygen(message + 4, r->data, &key, k_size, pool);
 
 	if (ret == 0)
 		return S0x6a82;	// file not found ..
@@ -1611,6 +1810,36 @@ Use public key with "uncompressed" indicator (byte 04 at start)
 	RESP_READY(ret + add);
 }
 
+#ifdef RSA_PRIME_POOL
+// OsEID extension, P1 = 0x80: generate one RSA prime into prime pool,
+// P2 = key size / 256 (prime is half of modulus)
+static __attribute__((noinline))
+uint8_t myeid_fill_prime_pool(uint8_t * message, struct iso7816_response *r)
+{
+	struct rsa_crt_key key;
+	rsa_num p;
+	uint8_t sizes[RSA_PRIME_POOL];
+	uint8_t size = M_P2 * 16;
+	uint8_t ret;
+
+	if (M_P3 || check_rsa_key_size(M_P2 * 256))
+		return S0x6a86;	//Incorrect parameters P1-P2
+	ret = fs_prime_pool_check();
+	if (ret != S_RET_OK)
+		return ret;
+	// count free slots
+	if (!fs_prime_pool_status(sizes, 0))
+		return S0x6a84;	//not enough memory space in the file
+
+	card_io_start_null();
+	rsa_pool_prime(&p, &key, (rsa_long_num *) r->data, size);
+	ret = fs_prime_pool_put(p.value, size);
+	memset(&p, 0, sizeof(p));
+	memset(&key, 0, sizeof(key));
+	return ret;
+}
+#endif
+
 // generate key, file is already selected,
 // key type/size can be determined only from file size/file type
 // file type 0x11:
@@ -1621,6 +1850,7 @@ Use public key with "uncompressed" indicator (byte 04 at start)
 // file size 0x0209 = 521 EC key secp521r1
 // file size 0x0180 = 384 EC key secp384r1
 // file size 0x0100 = 256 EC key prime256v1
+// file size 0x00E0 = 224 EC key secp224r1
 // file size 0x00C0 = 192 EC key prime192v1
 // OsEID special, file type 0x23:
 // file size 0x0100 = secp256k1 key file
@@ -1632,13 +1862,26 @@ uint8_t myeid_generate_key(uint8_t * message, struct iso7816_response *r)
 
 	DPRINT("%s %02x %02x\n", __FUNCTION__, M_P1, M_P2);
 
+#ifdef RSA_PRIME_POOL
+	if (M_P1 == 0x80)
+		return myeid_fill_prime_pool(message, r);
+#endif
+#ifdef RSA_MULTI_PRIME
+	// OsEID extension, P1 = 3 - three prime RSA key
+	if ((M_P1 != 0 && M_P1 != 3) || M_P2 != 0)
+#else
 	if (M_P1 != 0 || M_P2 != 0)
+#endif
 		return S0x6a86;	//Incorrect parameters P1-P2
 
 	type = fs_get_file_type();
 	// check file type
 	if (type == RSA_KEY_EF)
 		return myeid_generate_rsa_key(message, r);
+#ifdef RSA_MULTI_PRIME
+	if (M_P1)
+		return S0x6a86;	//Incorrect parameters P1-P2
+#endif
 
 // EC key generation is requested.., for now no user data are allowed
 	if (M_P3)
@@ -1664,7 +1907,7 @@ uint8_t myeid_generate_key(uint8_t * message, struct iso7816_response *r)
 #else
 	struct ec_param *c = (struct ec_param *)(message);
 #endif
-// get key size (from file size) - 192, 256, 384, 521 bits
+// get key size (from file size) - 192, 224, 256, 384, 521 bits
 // also check key file type (0x22, 0x23)
 	k_size = fs_get_file_size();
 	if (check_ec_key_file(k_size, type))
@@ -1758,6 +2001,12 @@ uint8_t myeid_get_data(uint8_t * message, struct iso7816_response *r)
 
 	DPRINT("%s %02x %02x\n", __FUNCTION__, M_P1, M_P2);
 
+	// OsEID: file list with file info, P1 = page (1..6)
+	if (M_P2 == 0xa7) {
+		if (M_P1 < 1 || M_P1 > 6)
+			return S0x6a86;	//Incorrect parameters P1-P2
+		return fs_list_files_info(M_P1 - 1, r);
+	}
 	if (M_P1 != 1)
 		return S0x6a88;	//Referenced data (data objects) not found
 
@@ -1784,9 +2033,19 @@ uint8_t myeid_get_data(uint8_t * message, struct iso7816_response *r)
 	case 0xa5:
 	case 0xa6:
 		return fs_list_files(M_P2, r);
+	case 0xa8:
+		return fs_get_journal(r);
 	case 0xaa:
 		get_constant(response, N_CARD_CAP_ID);
 		RESP_READY(11);
+#ifdef RSA_PRIME_POOL
+	case 0xa9:
+		// prime pool, for each slot key size / 256 (0 = free slot)
+		fs_prime_pool_status(response, 0);
+		for (ret = 0; ret < RSA_PRIME_POOL; ret++)
+			response[ret] /= 16;
+		RESP_READY(RSA_PRIME_POOL);
+#endif
 	case 0xac:
 		ret = fs_get_access_condition();
 		response[0] = ret >> 8;
@@ -1808,11 +2067,11 @@ uint8_t myeid_get_data(uint8_t * message, struct iso7816_response *r)
 		ret = ret * 8;
 		response[2] = ret >> 8;
 		response[3] = ret & 0xff;
-		ret = fs_key_read_part(NULL, KEY_RSA_p);
+		ret = rsa_modulus_size();
 		DPRINT("ret=%d\n", ret);
 		if (!ret)
 			return S0x6a88;	//Referenced data (data objects) not found
-		ret = ret * 16;
+		ret = ret * 8;
 		response[4] = ret >> 8;
 		response[5] = ret & 0xff;
 		RESP_READY(6);
@@ -1821,7 +2080,7 @@ uint8_t myeid_get_data(uint8_t * message, struct iso7816_response *r)
 #if RSA_BYTES > 128
 #error posible overflow in response buffer
 #endif
-		ret = rsa_modulus(response);
+		ret = rsa_modulus(response, fs_get_file_size());
 		if (!ret)
 			return S0x6a88;	//Referenced data (data objects) not found
 		ret *= 2;
@@ -1845,7 +2104,116 @@ uint8_t myeid_get_data(uint8_t * message, struct iso7816_response *r)
 	}
 }
 
-static uint8_t myeid_upload_ec_key(uint8_t * message, uint16_t size)
+// Chained key upload: each APDU of chain is written directly to the key
+// file (at the end of chain only TAG and LEN of key part is written), the
+// key part is not collected in RAM. RSA key parts are big endian numbers,
+// they are stored reversed - from the end of the key part. Leading zeros
+// are skipped, if the number is shorter than the key part, the number is
+// moved down at the end of chain.
+static uint8_t key_stream_hdr[2] __attribute__((section(".noinit")));
+static uint16_t key_stream_offset __attribute__((section(".noinit")));
+static uint16_t key_stream_len __attribute__((section(".noinit")));
+static uint8_t key_stream_pos __attribute__((section(".noinit")));
+
+static uint8_t myeid_stream_key(uint8_t * message, struct iso7816_response *r,
+				uint8_t type, uint8_t size, uint8_t rsa)
+{
+	uint8_t *data = message + 5;
+	uint8_t len = r->Nc;
+	uint8_t ret;
+
+	DPRINT("%s type %02x, state %d, block %d, offset %d\n", __FUNCTION__, type,
+	       r->chaining_state, len, key_stream_len);
+
+	if (r->chaining_state == APDU_CHAIN_START) {
+		key_stream_hdr[0] = type;
+		key_stream_hdr[1] = size;
+		key_stream_len = 0;
+		key_stream_pos = 0;
+		ret = fs_key_part_begin(key_stream_hdr, &key_stream_offset);
+		if (ret != S_RET_OK)
+			return ret;
+	} else if (key_stream_hdr[0] != type || key_stream_hdr[1] != size) {
+		ret = S0x6a86;	// Incorrect parameters P1-P2
+		goto abort;
+	}
+	// RSA key part may start with 0x00 (one byte more in key part)
+	if (key_stream_len + len > size + rsa) {
+		ret = S0x6700;	// Incorrect length
+		goto abort;
+	}
+	if (rsa) {
+		key_stream_len += len;
+		if (!key_stream_pos)
+			while (len && *data == 0) {
+				data++;
+				len--;
+			}
+		if (key_stream_pos + len > size) {
+			ret = S0x6700;	// Incorrect length
+			goto abort;
+		}
+		reverse_string(data, len);
+		ret = fs_key_part_write(key_stream_offset, size - key_stream_pos - len, data, len);
+		key_stream_pos += len;
+	} else {
+		if (!key_stream_len && type == KEY_EC_PUBLIC && *data != 4) {
+			ret = S0x6985;	//    Conditions not satisfied
+			goto abort;
+		}
+		ret = fs_key_part_write(key_stream_offset, key_stream_len, data, len);
+		key_stream_len += len;
+	}
+	if (ret != S_RET_OK)
+		goto abort;
+
+	// data are in key file, do not concatenate next APDU
+	if (r->chaining_state & APDU_CHAIN_RUNNING) {
+		r->chain_len = 0;
+		return S_RET_OK;
+	}
+	// last APDU in chain
+	if (rsa) {
+		if (key_stream_len < size) {
+			ret = S0x6700;	// Incorrect length
+			goto abort;
+		}
+		card_io_start_null();
+		data = r->data;
+		len = size - key_stream_pos;
+		if (len) {
+			DPRINT("moving key part down by %d bytes\n", len);
+			ret = fs_key_part_read(key_stream_offset, len, data, key_stream_pos);
+			if (ret != S_RET_OK)
+				goto abort;
+			memset(data + key_stream_pos, 0, len);
+			ret = fs_key_part_write(key_stream_offset, 0, data, size);
+			if (ret != S_RET_OK)
+				goto abort;
+		}
+	} else if (key_stream_len != size) {
+		ret = S0x6700;	// Incorrect length
+		goto abort;
+	}
+	ret = fs_key_part_commit(key_stream_hdr, key_stream_offset);
+#ifdef USE_P_Q_INV
+	// calculate n_ and Barrett constant, p/q is read back from key file
+	if (ret == S_RET_OK && KEY_RSA_PRIME(type)) {
+		memset(data, 0, RSA_BYTES);
+		ret = fs_key_part_read(key_stream_offset, 0, data, size);
+		if (ret == S_RET_OK)
+			ret = key_constants(type, data, size);
+	}
+#endif
+	return ret;
+ abort:
+	// part of key is already written, clear it (not parsed as key part)
+	fs_key_part_abort(key_stream_hdr, key_stream_offset);
+	return ret;
+}
+
+static uint8_t myeid_upload_ec_key(uint8_t * message, struct iso7816_response *r,
+				   uint16_t size)
 {
 	DPRINT("%s %02x %02x %02x\n", __FUNCTION__, M_P1, M_P2, M_P3);
 	uint8_t key_bytes = (size + 7) / 8;
@@ -1856,35 +2224,94 @@ static uint8_t myeid_upload_ec_key(uint8_t * message, uint16_t size)
 		// public key - two numbers and uncompressed indicator
 		key_bytes = 2 * key_bytes + 1;
 		message[3] = KEY_EC_PUBLIC;
-		// check uncompressed indicator
-		if (message[5] != 4)
-			return S0x6985;	//    Conditions not satisfied
 	} else
 		return S0x6a86;	// Incorrect parameters P1-P2
+	// uncompressed indicator of public key is checked in myeid_stream_key()
+	if (r->chaining_state != APDU_CHAIN_INACTIVE)
+		return myeid_stream_key(message, r, message[3], key_bytes, 0);
+	// check uncompressed indicator
+	if (message[3] == KEY_EC_PUBLIC && message[5] != 4)
+		return S0x6985;	//    Conditions not satisfied
 	if (key_bytes != M_P3)
 		return S0x6700;	// Incorrect length
 	card_io_start_null();
 	return fs_key_write_part(message + 3);
 }
 
-static uint8_t myeid_upload_rsa_key(uint8_t * message, uint16_t size)
+// public exponent in APDU (big endian), P and Q must be already uploaded,
+// store public exponent and calculate dP, dQ, qInv (n_ and Barrett
+// constants for P, Q are already calculated by P, Q upload)
+static __attribute__((noinline))
+uint8_t myeid_rsa_derive_crt(uint8_t * message, struct iso7816_response *r, uint16_t size)
 {
-	uint16_t test_size;
-	uint8_t m_size = M_P3;
+	struct rsa_crt_key key;
+	rsa_num *p = (rsa_num *) r->data;
+	rsa_num *q = (rsa_num *) (r->data + RSA_BYTES);
+	rsa_num *part;
+	uint8_t m_size = size / 16;
+	uint8_t *e = message + 5;
+	uint8_t e_len = M_P3;
+	uint8_t i, ret;
+
+	while (e_len && *e == 0) {
+		e++;
+		e_len--;
+	}
+	// CRT fault check in rsa_calculate() uses fixed public exponent 65537
+	// (same restriction as in key generation)
+	if (e_len != 3 || e[0] != 1 || e[1] != 0 || e[2] != 1)
+		return S0x6984;	//invalid data
 
-	DPRINT("uloading key type %02x\n", M_P2);
+	if (m_size != get_rsa_key_part(p, KEY_RSA_p))
+		return S0x6985;	//Conditions not satisfied
+	if (m_size != get_rsa_key_part(q, KEY_RSA_q)) {
+		ret = S0x6985;	//Conditions not satisfied
+		goto clear;
+	}
+	card_io_start_null();
 
-	// key part may start with 0x00 and M_P3 is incremented by one (65 bytes for 1024 key)
-	if ((m_size & 1) && (M_P2 != 0x81)) {
-		DPRINT("M_P3 is odd, message[5] = 0x%02x\n", message[5]);
-		if (message[5] != 0)
-			return S0x6985;	//    Conditions not satisfied
-		m_size--;
-		message[5] = m_size;
-		message[4] = message[3];
-		message++;
+	memset(&key, 0, sizeof(key));
+	for (i = 0; i < e_len; i++)
+		key.d.value[i] = e[e_len - 1 - i];
+
+	bn_set_bitlen(m_size * 8);
+	if (rsa_crt_params(p, q, &key)) {
+		ret = S0x6984;	//invalid data
+		goto clear;
+	}
+	// public exponent is stored in same format as by KEY_RSA_EXP_PUB upload
+	message[2] = KEY_RSA_EXP_PUB;
+	message[3] = e_len;
+	memcpy(message + 4, &key.d, e_len);
+	ret = fs_key_write_part(message + 2);
+
+	// dP, dQ, qInv are consecutive in struct rsa_crt_key
+	part = &key.dP;
+	for (i = KEY_RSA_dP; ret == S_RET_OK && i <= KEY_RSA_qInv; i++, part++) {
+		message[2] = i;
+		message[3] = m_size;
+		memcpy(message + 4, part, m_size);
+		ret = fs_key_write_part(message + 2);
 	}
+	memset(message + 4, 0, m_size);
+	memset(&key, 0, sizeof(key));
+ clear:
+	memset(r->data, 0, 2 * RSA_BYTES);
+	return ret;
+}
 
+static uint8_t myeid_upload_rsa_key(uint8_t * message, struct iso7816_response *r,
+				    uint16_t size)
+{
+	uint8_t m_size = M_P3;
+	uint8_t part_size = size / 16;	// CRT part of two prime key
+
+	DPRINT("uloading key type %02x\n", M_P2);
+
+#ifdef RSA_MULTI_PRIME
+	if (M_P2 >= KEY_RSA_r && size < RSA_MP_MIN_BITS)
+		return S0x6985;	//    Conditions not satisfied
+#endif
 	switch (M_P2) {
 // private exponent is not needed for CRT
 // modulus is not needed, card calculates modulus from P and Q
@@ -1894,22 +2321,60 @@ static uint8_t myeid_upload_rsa_key(uint8_t * message, uint16_t size)
 	case KEY_RSA_EXP_p2:
 	case KEY_RSA_EXP:
 	case KEY_RSA_MOD:
+		// ignore data, do not concatenate APDUs in chain
+		r->chain_len = 0;
 		return S_RET_OK;
 	case KEY_RSA_p:
 	case KEY_RSA_q:
 	case KEY_RSA_dP:
 	case KEY_RSA_dQ:
 	case KEY_RSA_qInv:
-		test_size = 16 * m_size;
+		if (r->chaining_state != APDU_CHAIN_INACTIVE)
+			return myeid_stream_key(message, r, M_P2, size / 16, 1);
+		break;
+#ifdef RSA_MULTI_PRIME
+	case KEY_RSA_r:
+	case KEY_RSA_dR:
+	case KEY_RSA_tR:
+		if (r->chaining_state != APDU_CHAIN_INACTIVE)
+			return myeid_stream_key(message, r, M_P2, RSA_MP_R_PART(size / 8), 1);
 		break;
+#endif
 	case KEY_RSA_EXP_PUB:
-// allow any size of public exponet, if this size does not fit in key file, this fail in fs_key_write_part ()
-		test_size = size;
+		// Wait for full APDU if chaining is active
+		if (r->chaining_state & APDU_CHAIN_RUNNING)
+			return S_RET_OK;
 		break;
+	case KEY_RSA_DERIVE:
+		if (r->chaining_state & APDU_CHAIN_RUNNING)
+			return S_RET_OK;
+		return myeid_rsa_derive_crt(message, r, size);
 	default:
 		return S0x6985;	//    Conditions not satisfied
 	}
-	if (size != test_size) {
+#ifdef RSA_MULTI_PRIME
+	// parts of three prime key (R, dR, tR and P, Q, dP, dQ, qInv)
+	if (M_P2 >= KEY_RSA_r)
+		part_size = RSA_MP_R_PART(size / 8);
+	else if (size >= RSA_MP_MIN_BITS && m_size != part_size && m_size != part_size + 1)
+		part_size = RSA_MP_PQ_PART(size / 8);
+	// balanced three prime key (RFC 8017, primes of same size) is not supported
+	if (size >= RSA_MP_MIN_BITS && m_size != part_size && m_size != part_size + 1)
+		if (m_size == (size / 3 + 7) / 8 || m_size == (size / 3 + 7) / 8 + 1)
+			return S0x6a80;	//Incorrect parameters in the data field
+#endif
+	// key part may start with 0x00 and M_P3 is incremented by one (65 bytes for 1024 key)
+	if ((m_size == part_size + 1) && (M_P2 != 0x81)) {
+		DPRINT("M_P3 is odd, message[5] = 0x%02x\n", message[5]);
+		if (message[5] != 0)
+			return S0x6985;	//    Conditions not satisfied
+		m_size--;
+		message[5] = m_size;
+		message[4] = message[3];
+		message++;
+	}
+// allow any size of public exponet, if this size does not fit in key file, this fail in fs_key_write_part ()
+	if (M_P2 != KEY_RSA_EXP_PUB && m_size != part_size) {
 		DPRINT("write size, key file %d size of part %d\n", size, m_size);
 		return S0x6700;	//Incorrect length
 	}
@@ -1918,13 +2383,13 @@ static uint8_t myeid_upload_rsa_key(uint8_t * message, uint16_t size)
 	reverse_string(message + 5, m_size);
 #ifdef USE_P_Q_INV
 	// calculate n_
-	if (M_P2 == KEY_RSA_p || M_P2 == KEY_RSA_q)
+	if (KEY_RSA_PRIME(M_P2))
 		return key_preproces(message + 3, m_size);
 #endif
 	return fs_key_write_part(message + 3);
 }
 
-static uint8_t myeid_upload_keys(uint8_t * message)
+static uint8_t myeid_upload_keys(uint8_t * message, struct iso7816_response *r)
 {
 	uint16_t k_size;
 	uint8_t type;
@@ -1932,6 +2397,12 @@ static uint8_t myeid_upload_keys(uint8_t * message)
 	DPRINT("%s \n", __FUNCTION__);
 // key upload, file is already selected,
 
+// P3 is not valid for extended/chained APDU, key part length is
+// stored in one byte in key file
+	if (r->Nc > 255)
+		return S0x6700;	//Incorrect length
+	M_P3 = r->Nc;
+
 	k_size = fs_get_file_size();
 	if (!k_size)
 		return S0x6a82;	//file not found
@@ -1950,29 +2421,36 @@ static uint8_t myeid_upload_keys(uint8_t * message)
 		if (k_size != 64 && k_size != 128 && k_size != 192)
 #endif
 			return S0x6700;	//Incorrect length
+		// Wait for full APDU if chaining is active
+		if (r->chaining_state & APDU_CHAIN_RUNNING)
+			return S_RET_OK;
 		return fs_key_write_part(message + 3);
 	}
 	if (type == AES_KEY_EF) {
 		if (k_size != 128 && k_size != 192 && k_size != 256)
 			return S0x6700;	//Incorrect length
+		// Wait for full APDU if chaining is active
+		if (r->chaining_state & APDU_CHAIN_RUNNING)
+			return S_RET_OK;
 		return fs_key_write_part(message + 3);
 	}
 	// file type is checked in check_ec_key_file(),
 	// size and key part type is checked in myeid_upload_ec_key()
 	if (0 == check_ec_key_file(k_size, type))
-		return myeid_upload_ec_key(message, k_size);
+		return myeid_upload_ec_key(message, r, k_size);
 
 	// size and key part type is checked in myeid_upload_rsa_key()
 	if (type == RSA_KEY_EF)
 		if (0 == check_rsa_key_size(k_size))
-			return myeid_upload_rsa_key(message, k_size);
+			return myeid_upload_rsa_key(message, r, k_size);
 
 	return S0x6981;		//icorrect file type
 }
 
-uint8_t myeid_put_data(uint8_t * message, __attribute__((unused))
-		       struct iso7816_response *r)
+uint8_t myeid_put_data(uint8_t * message, struct iso7816_response *r)
 {
+	uint8_t ret;
+
 	DPRINT("%s %02x %02x\n", __FUNCTION__, M_P1, M_P2);
 
 	if (M_P1 != 1)
@@ -1989,6 +2467,24 @@ uint8_t myeid_put_data(uint8_t * message, __attribute__((unused))
 		card_io_start_null();
 		return fs_erase_card(message + 4);
 	}
+	// create file tree (bulk personalization), APDUs in chain are processed one by one
+	if (M_P2 == 0xe1) {
+		if (r->chaining_state <= APDU_CHAIN_START) {
+			ret = fs_tree_begin();
+			if (ret != S_RET_OK)
+				return ret;
+		}
+		ret = fs_tree_add(message + 5, r->Nc);
+		if (ret != S_RET_OK) {
+			fs_tree_abort();
+			return ret;
+		}
+		if (r->chaining_state & APDU_CHAIN_RUNNING) {
+			r->chain_len = 0;
+			return S_RET_OK;
+		}
+		return fs_tree_commit();
+	}
 	//initialize PIN
 	if (M_P2 > 0 && M_P2 < 15) {
 		if (M_P3 < 0x10 || M_P3 > (16 + 7 + 24))
@@ -1998,8 +2494,12 @@ uint8_t myeid_put_data(uint8_t * message, __attribute__((unused))
 	}
 	// Upload keys, Nc > 0 (checked in APDU parser)
 
-	if ((M_P2 >= 0x80 && M_P2 <= 0x8B) || (M_P2 == 0xA0))
-		return myeid_upload_keys(message);
+#ifdef RSA_MULTI_PRIME
+	if ((M_P2 >= 0x80 && M_P2 <= KEY_RSA_tR) || (M_P2 == 0xA0))
+#else
+	if ((M_P2 >= 0x80 && M_P2 <= 0x8C) || (M_P2 == 0xA0))
+#endif
+		return myeid_upload_keys(message, r);
 
 	return S0x6a81;		//Function not supported
 }
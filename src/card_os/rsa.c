@@ -410,10 +410,146 @@ void partial_barret(rsa_long_num * num, rsa_num * Bc)
 	num->value[offset] = carry;
 }
 
+#ifdef RSA_NEWTON_CONSTANTS
+// smallest available half size multiplication for "size" bytes operands
+static uint8_t rsa_half_kernel(uint8_t size)
+{
+	if (size <= 16)
+		return 16;
+	if (size <= 24)
+		return 24;
+	if (size <= 32)
+		return 32;
+	if (size <= 48)
+		return 48;
+	return 64;
+}
+
+/*
+Barrett constant Bc = 2^1.5n mod M by Newton iteration (M - modulus, n bits,
+highest bit set)
+
+Reciprocal V of upper half of modulus is calculated first.  Let M_q be upper
+q bits of modulus, V_q = (2^(2q-1) - 1) / M_q.  V_16 is calculated by 32/16
+bit division, then precision is (almost) doubled in each step, q = 2p - 8
+(one byte is lost, otherwise error of V grows in each step):
+
+   E = 2^(p+q) - 2 * M_q * V_p	(small signed number)
+   V_q = V_p * 2^(q-p) + V_p * E / 2^2p
+
+Error of V_q is max 1.  Multiplications use smallest available size of
+multiplication routine.  Quotient Q = 2^1.5n / M is then estimated as
+2 * V_n/2 - K (2 * V_n/2 is in range Q - 1 .. Q + 4, Q is underestimated
+max. by K + 1):
+
+   Bc = 2^1.5n - Q * M
+
+and Bc is reduced by fixed count of subtractions of M (constant time).
+*/
+#define NEWTON_K 6
+#define NEWTON_SUB (NEWTON_K + 2)
+
+static void barrett_constant_newton(rsa_num * Bc, rsa_num * modulus)
+{
+	uint8_t len = rsa_get_len();
+	uint8_t hsize = len / 2;
+	uint8_t *m = modulus->value;
+	uint8_t p, q, k, i, mask, carry, idx;
+	uint32_t v;
+	rsa_half_num V, A;
+	rsa_long_num t1, t2;
+	uint8_t w[RSA_BYTES + 8];
+	uint8_t *r[2];
+
+// 16 bit reciprocal
+	v = ((uint32_t) 1 << 31) - 1;
+	v /= ((uint16_t) m[len - 1] << 8) | m[len - 2];
+	memset(&V, 0, sizeof(rsa_half_num));
+	V.value[0] = v;
+	V.value[1] = v >> 8;
+
+	for (p = 2; p < hsize; p = q) {
+		q = 2 * p - 1;
+		if (q > hsize)
+			q = hsize;
+		k = rsa_half_kernel(q);
+		rsa_set_len(2 * k);
+
+		// E = 2^(p+q) - 2 * M_q * V_p
+		memset(&A, 0, k);
+		memcpy(&A, m + len - q, q);
+		rsa_mul_half((rsa_num *) & t1, &A, &V);
+		bn_shift_L_v(&t1, 2 * k);
+		memset(&t2, 0, 2 * k);
+		t2.value[p + q] = 1;
+		bn_sub_v(&t2, &t2, &t1, 2 * k);
+
+		// E/256 fits in k bytes (signed), V_p * E/256
+		memcpy(&A, &t2.value[1], k);
+		mask = -(A.value[k - 1] >> 7);
+		rsa_mul_half((rsa_num *) & t1, &V, &A);
+		for (i = 0; i < k; i++)
+			A.value[i] = V.value[i] & mask;
+		bn_sub_v(&t1.value[k], &t1.value[k], &A, k);
+
+		// D = V_p * E / 2^2p, sign extended to q bytes
+		mask = -(t1.value[2 * k - 1] >> 7);
+		for (i = 0; i < q; i++)
+			t2.value[i] = (2 * p - 1 + i < 2 * k) ? t1.value[2 * p - 1 + i] : mask;
+
+		// V_q = V_p * 2^(q-p) + D, clamp on overflow (only positive D)
+		memmove(&V.value[q - p], &V, p);
+		memset(&V, 0, q - p);
+		carry = bn_add_v(&V, &t2, q, 0);
+		carry &= ~mask;
+		mask = -carry;
+		for (i = 0; i < q; i++)
+			V.value[i] |= mask;
+	}
+	rsa_set_len(len);
+
+// Q = 2 * V - K  (hsize bytes in V + one bit in carry)
+	carry = bn_shift_L_v(&V, hsize);
+	memset(&A, 0, hsize);
+	A.value[0] = NEWTON_K;
+	carry -= bn_sub_v(&V, &V, &A, hsize);
+
+// Q * M, only low len + 8 bytes
+	rsa_mul_half((rsa_num *) & t1, &V, (rsa_half_num *) m);
+	memset(&t1.value[len], 0, 8);
+	rsa_mul_half((rsa_num *) & t2, &V, (rsa_half_num *) (m + hsize));
+	bn_add_v(&t1.value[hsize], &t2, hsize + 8, 0);
+	mask = -carry;
+	for (i = 0; i < hsize + 8; i++)
+		w[i] = m[i] & mask;
+	bn_add_v(&t1.value[hsize], w, hsize + 8, 0);
+
+// Bc = 2^1.5n - Q * M  (2^1.5n is above len + 8 bytes)
+	memset(w, 0, len + 8);
+	bn_sub_v(w, w, &t1, len + 8);
+
+	memcpy(&t1, m, len);
+	memset(&t1.value[len], 0, 8);
+	r[0] = w;
+	r[1] = t2.value;
+	idx = 0;
+	for (i = 0; i < NEWTON_SUB; i++)
+		idx ^= 1 ^ bn_sub_v(r[idx ^ 1], r[idx], &t1, len + 8);
+
+	memcpy(Bc, r[idx], len);
+}
+#endif
+
 void barrett_constant(rsa_num * Bc, rsa_num * modulus)
 {
 	rsa_long_num tmp;
 
+#ifdef RSA_NEWTON_CONSTANTS
+	if (modulus->value[rsa_get_len() - 1] & 0x80) {
+		barrett_constant_newton(Bc, modulus);
+		return;
+	}
+#endif
 	memset(&tmp, 0, sizeof(rsa_long_num));
 	tmp.value[(rsa_get_len() * 3) / 2] = 1;
 
@@ -443,6 +579,45 @@ void barrett_constant(rsa_num * Bc, rsa_num * modulus)
 
 // This C version of code is not constant time, but AVR ASM version is constant time.
 
+#ifdef RSA_NEWTON_CONSTANTS
+// n_ = - n^-1 mod r by Hensel lifting (Newton iteration), start with 32 bits:
+// y = y * (2 + n * y) mod 2^2p, y is valid for p bits.
+// Only truncated multiplications are used, code is constant time.
+
+void rsa_inv_mod_N(rsa_half_num * Mc, rsa_num * modulus)
+{
+	uint8_t len = rsa_get_len();
+	uint8_t hsize = len / 2;
+	uint8_t p, k, i;
+	uint32_t n0, x;
+	rsa_half_num t, y;
+
+	n0 = modulus->value[0] | (uint16_t) modulus->value[1] << 8 |
+	    (uint32_t) modulus->value[2] << 16 | (uint32_t) modulus->value[3] << 24;
+	// n0 * n0 = 1 mod 8 (n0 is odd)
+	x = n0;
+	for (i = 0; i < 4; i++)
+		x *= 2 - n0 * x;
+	x = -x;
+
+	memset(&y, 0, sizeof(rsa_half_num));
+	for (i = 0; i < 4; i++, x >>= 8)
+		y.value[i] = x;
+
+	for (p = 4; p < hsize; p *= 2) {
+		k = rsa_half_kernel(2 * p < hsize ? 2 * p : hsize);
+		rsa_set_len(2 * k);
+		rsa_mul_mod_half(&t, (rsa_half_num *) modulus, &y);
+		memset(Mc, 0, k);
+		Mc->value[0] = 2;
+		bn_add_v(&t, Mc, k, 0);
+		rsa_mul_mod_half(Mc, &y, &t);
+		memcpy(&y, Mc, k);
+	}
+	rsa_set_len(len);
+	memcpy(Mc, &y, hsize);
+}
+#else
 void
     __attribute__((weak)) rsa_inv_mod_N(rsa_half_num * Mc, rsa_num * modulus)
 {
@@ -469,6 +644,7 @@ void
 			Mc->value[b_pos++] = res, res = 0, mask = 1, loop--;
 	}
 }
+#endif
 
 // modular reduction
 //---------------------
@@ -848,13 +1024,46 @@ static uint8_t rsaGetKeyModulus(rsa_num * modulus, rsa_num * Bc, uint16_t size,
 	return 0;
 }
 
+#ifdef RSA_MULTI_PRIME
+// r = r + a * b, 'a' is rsa_num, 'b' is 2*len number, result is "size"
+// bytes long (size > 2 * len), r(2*len .. size) is cleared here
+static void rsa_mul_add_long(uint8_t * r, rsa_num * a, rsa_long_num * b,
+			     rsa_long_num * tmp, uint16_t size)
+{
+	uint8_t len = rsa_get_len();
+
+	memset(r + 2 * len, 0, size - 2 * len);
+	rsa_mul(tmp, a, (rsa_num *) b);
+	r[2 * len] = bn_add_v(r, tmp, 2 * len, 0);
+	rsa_mul(tmp, a, (rsa_num *) (&b->value[len]));
+	bn_add_v(r + len, tmp, size - len, 0);
+}
+#endif
+
 // key file is selected, function reads P,Q, and store modoulus to m
 // return 0 if error, sizze of CRT component (128  for 2048 bit key)
-uint8_t rsa_modulus(void *m)
+// (for three prime key half of modulus size, size = key size in bits)
+uint8_t rsa_modulus(void *m, uint16_t size)
 {
-	uint16_t size;
 	rsa_num p, q;
-
+#ifdef RSA_MULTI_PRIME
+	rsa_long_num t[2];
+	uint8_t part = RSA_MP_R_PART(size / 8);
+
+	if (part && part == get_rsa_key_part(&p, KEY_RSA_r)) {
+		part = RSA_MP_PQ_PART(size / 8);
+		if (part != get_rsa_key_part(&q, KEY_RSA_q))
+			return 0;
+		if (part != get_rsa_key_part(&t[1], KEY_RSA_p))
+			return 0;
+		bn_set_bitlen(part * 8);
+		// t[0] = P * Q, modulus = 0 + R * P * Q (R is not longer than P)
+		rsa_mul(&t[0], &t[1].L, &q);
+		memset(m, 0, rsa_get_len() * 2);
+		rsa_mul_add_long(m, &p, &t[0], &t[1], size / 8);
+		return size / 16;
+	}
+#endif
 	size = get_rsa_key_part(&p, KEY_RSA_p);
 	if (!size)
 		return 0;
@@ -866,6 +1075,33 @@ uint8_t rsa_modulus(void *m)
 	return size;
 }
 
+#ifdef RSA_MULTI_PRIME
+// reduce message of 'size' bytes (size > len) modulo 'modulus', message
+// is reduced from upper part, one 'len' bytes block in one step,
+// result in t (len bytes)
+static void rsa_mod_message(rsa_long_num * t, uint8_t * msg, uint16_t size,
+			    rsa_num * modulus, rsa_num * Bc)
+{
+	uint8_t len = rsa_get_len();
+	uint8_t rest = size % len;
+
+	if (!rest)
+		rest = len;
+	size -= rest;
+	memset(t, 0, sizeof(rsa_long_num));
+	memcpy(t, msg + size, rest);
+	for (;;) {
+		partial_barret(t, Bc);
+		bn_mod_half(t, modulus);
+		if (!size)
+			break;
+		size -= len;
+		memcpy(&t->value[len], t, len);
+		memcpy(t, msg + size, len);
+	}
+}
+#endif
+
 /******************************************************************
 *******************************************************************/
 /// result = 0 if all ok, or error code
@@ -875,11 +1111,15 @@ uint8_t rsa_modulus(void *m)
 uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 {
 	uint16_t count;
+	uint8_t psize;
 	rsa_exp_num exponent;
 	rsa_num *tmp = &exponent.n;
 
 	rsa_long_num t[2];
 	rsa_half_num Mc;
+#ifdef RSA_MULTI_PRIME
+	rsa_num m3;
+#endif
 
 #define H (&t[0])
 #define TMP1 tmp
@@ -898,6 +1138,53 @@ uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 		return Re_DATA_RESULT_SAME;
 	}
 
+#ifdef RSA_MULTI_PRIME
+// three prime key, exponentiation modulo R first, R is stored in upper
+// part of result, Bc for R in lower part of result, message is unchanged
+#define R3 (rsa_num *)(&result[RSA_BYTES])
+#define R3_Bc (rsa_num *)(&result[0])
+	psize = RSA_MP_R_PART(size * 2);
+	if (psize && psize == get_rsa_key_part(&m3, KEY_RSA_r)) {
+		bn_set_bitlen(psize * 8);
+		if (rsaGetKeyModulus(R3, R3_Bc, psize, KEY_RSA_r))
+			return Re_R3_GET_FAIL_1;
+		rsa_mod_message(H, data, size * 2, R3, R3_Bc);
+		memcpy(&m3, H, rsa_get_len());
+
+		memset(&exponent, 0, sizeof(rsa_exp_num));
+		if (psize != get_rsa_key_part(&exponent, KEY_RSA_dR)) {
+			DPRINT("ERROR, unable to get (dR) part of key\n");
+			return Re_dR_1;
+		}
+		count = rsaExpMod_montgomery_eblind(t, &exponent, R3);
+		if (rsaExpMod_montgomery_init(t, R3, &Mc, &m3, KEY_RSA_r))
+			return Re_R3_GET_FAIL_1;
+		if (rsaExpMod_montgomery(&m3, &exponent, R3, &Mc, R3_Bc, t, count, 16))
+			return Re_R3_Single_Error;
+
+// message is bigger than 2 * len, reduce message modulo P and Q
+// (Q is last, message is overwritten by result)
+		psize = RSA_MP_PQ_PART(size * 2);
+		bn_set_bitlen(psize * 8);
+		if (rsaGetKeyModulus(TMP1, TMP2, psize, KEY_RSA_p))
+			return Re_P_GET_FAIL_1;
+		rsa_mod_message(H, data, size * 2, TMP1, TMP2);
+		memcpy(M1, H, rsa_get_len());
+
+		if (rsaGetKeyModulus(TMP1, TMP2, psize, KEY_RSA_q))
+			return Re_Q_GET_FAIL_1;
+		rsa_mod_message(H, data, size * 2, TMP1, TMP2);
+		memcpy(M2, H, rsa_get_len());
+
+// load Q and Bc for Q, continue in two prime code
+		if (rsaGetKeyModulus(TMP3, TMP2, psize, KEY_RSA_q))
+			return Re_Q_GET_FAIL_1;
+		goto rsa_calculate_q;
+	}
+#undef R3
+#undef R3_Bc
+#endif
+	psize = size;
 	bn_set_bitlen(size * 8);
 
 // duplicate message
@@ -924,9 +1211,12 @@ uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 // save Q
 	memcpy(TMP3, TMP1, RSA_BYTES);
 
+#ifdef RSA_MULTI_PRIME
+ rsa_calculate_q:
+#endif
 // load exponent
 	memset(&exponent, 0, sizeof(rsa_exp_num));
-	if (size != get_rsa_key_part(&exponent, KEY_RSA_dQ)) {
+	if (psize != get_rsa_key_part(&exponent, KEY_RSA_dQ)) {
 		DPRINT("ERROR, unable to get (dQ) part of key\n");
 		return Re_dQ_1;
 	}
@@ -943,12 +1233,12 @@ uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 		return Re_Q_Single_Error;
 
 // load P and calculate Bc or load Bc from file
-	if (rsaGetKeyModulus(TMP3, TMP2, size, KEY_RSA_p))
+	if (rsaGetKeyModulus(TMP3, TMP2, psize, KEY_RSA_p))
 		return Re_Q_GET_FAIL_1;
 
 // load exponent
 	memset(&exponent, 0, sizeof(rsa_exp_num));
-	if (size != get_rsa_key_part(&exponent, KEY_RSA_dP)) {
+	if (psize != get_rsa_key_part(&exponent, KEY_RSA_dP)) {
 		DPRINT("ERROR, unable to get (dP) part of key\n");
 		return Re_dP_1;
 	}
@@ -986,7 +1276,7 @@ uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 	bn_mod_half(H, TMP3);
 
 // calculate M_P= h * q
-	if (size != get_rsa_key_part(TMP1, KEY_RSA_q)) {
+	if (psize != get_rsa_key_part(TMP1, KEY_RSA_q)) {
 		DPRINT("ERROR, unable to get (q) part of key\n");
 		return Re_Q_GET_FAIL_2;
 	}
@@ -996,6 +1286,35 @@ uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 	// M_Q is M2
 	rsa_add_long(M_P, M_Q);
 
+#ifdef RSA_MULTI_PRIME
+	if (psize != size) {
+// three prime key, M_P is result modulo P * Q, Garner's recombination
+// with R: m = M_P + ((m3 - M_P) * tR mod R) * P * Q
+// data buffer is free, R in data, Bc in data + RSA_BYTES, tR in TMP1
+		bn_set_bitlen(RSA_MP_R_PART(size * 2) * 8);
+		if (rsaGetKeyModulus(M2, (rsa_num *) (data + RSA_BYTES), rsa_get_len(), KEY_RSA_r))
+			return Re_R3_GET_FAIL_1;
+		rsa_mod_message(H, result, psize * 2, M2, (rsa_num *) (data + RSA_BYTES));
+		bn_sub_mod(&m3, (rsa_num *) H, M2);
+
+		if (rsa_get_len() != get_rsa_key_part(TMP1, KEY_RSA_tR)) {
+			DPRINT("ERROR, unable to get (tR) part of key\n");
+			return Re_tR_GET_FAIL_1;
+		}
+		rsa_mul(H, TMP1, &m3);
+		partial_barret(H, (rsa_num *) (data + RSA_BYTES));
+		bn_mod_half(H, M2);
+		memcpy(&m3, H, rsa_get_len());
+
+// P * Q into H (sizes of P, Q are already checked), R is not longer
+// than P, Q, upper part of m3 is zero
+		bn_set_bitlen(psize * 8);
+		get_rsa_key_part(data, KEY_RSA_p);
+		get_rsa_key_part(data + RSA_BYTES, KEY_RSA_q);
+		rsa_mul(H, M2, (rsa_num *) (data + RSA_BYTES));
+		rsa_mul_add_long(result, &m3, H, &t[1], size * 2);
+	}
+#endif
 	NPRINT("final result:\n", M_P, rsa_get_len() * 2);
 	return 0;
 #undef H
@@ -1003,6 +1322,169 @@ uint8_t rsa_calculate(uint8_t * data, uint8_t * result, uint16_t size)
 
 #ifdef RSA_GEN_DEBUG
 uint8_t debug_rm_count;
+#ifdef RSA_BPSW
+uint8_t debug_lucas_count;
+#endif
+#endif
+
+#ifdef RSA_BPSW
+// Jacobi symbol (a/n), a is small number, n is odd
+static int8_t rsa_jacobi(uint16_t a, rsa_num * n)
+{
+	uint16_t b, tmp;
+	uint32_t r;
+	uint8_t i, m = n->value[0];
+	int8_t j = 1;
+
+	while (!(a & 1)) {
+		a >>= 1;
+		if ((m & 7) == 3 || (m & 7) == 5)
+			j = -j;
+	}
+	if ((a & 3) == 3 && (m & 3) == 3)
+		j = -j;
+// (n/a), n mod a
+	r = 0;
+	for (i = rsa_get_len(); i > 0;) {
+		i--;
+		r = ((r << 8) | n->value[i]) % a;
+	}
+	b = r;
+	while (b) {
+		while (!(b & 1)) {
+			b >>= 1;
+			if ((a & 7) == 3 || (a & 7) == 5)
+				j = -j;
+		}
+		tmp = a;
+		a = b;
+		b = tmp;
+		if ((a & 3) == 3 && (b & 3) == 3)
+			j = -j;
+		b %= a;
+	}
+	return a == 1 ? j : 0;
+}
+
+// r = a * b (Montgomery), a == r is allowed
+static void
+lucas_mul(rsa_num * r, rsa_num * a, rsa_num * b, rsa_long_num t[2],
+	  rsa_num * n, rsa_half_num * Mc, rsa_num * Bc)
+{
+	uint8_t v;
+
+	memcpy(&t[1], a, rsa_get_len());
+	if (a == b)
+		v = monPro_square(&t[0], &t[1], n, Mc, Bc);
+	else
+		v = monPro(b, &t[0], &t[1], n, Mc, Bc);
+	memcpy(r, &t[v ^ 1], rsa_get_len());
+}
+
+// r = r - c mod n
+static void lucas_sub(rsa_num * r, rsa_num * c, rsa_num * n)
+{
+	if (rsa_sub(r, r, c))
+		rsa_add(r, n);
+}
+
+// c = x * R mod n (Montgomery form of small number x)
+static void lucas_const(rsa_num * c, uint8_t x, rsa_long_num t[2], rsa_num * n)
+{
+	memset(t, 0, RSA_BYTES * 2);
+	t[0].value[rsa_get_len() / 2] = x;
+	bn_mod_half(&t[0], n);
+	memcpy(c, &t[0], rsa_get_len());
+}
+
+// extra strong Lucas probable prime test (Q = 1, P = 3, 4, 5 ..
+// 1st P for which Jacobi (D/n) = -1, D = P^2 - 4)
+// n + 1 = d * 2^s, n is probable prime if:
+// U(d) = 0 and V(d) = +-2 mod n, or V(d * 2^r) = 0 mod n, 0 <= r < s - 1
+// U(d) = 0 is tested by 2 * V(d+1) = P * V(d) (D * U(d) = 2 * V(d+1) - P * V(d))
+// Montgomery ladder: V(2k) = V(k)^2 - 2, V(2k+1) = V(k) * V(k+1) - P
+// return 0 probably prime, 1 composite
+static uint8_t __attribute__((noinline))
+    lucas(rsa_num * n, rsa_exp_num * exponent, rsa_long_num t[2],
+	  rsa_num * Bc, rsa_half_num * Mc)
+{
+	rsa_num *d = &(exponent->n);
+	rsa_num v[2];
+	rsa_num two, pr;
+	uint8_t p, bit, s = 0;
+	uint16_t i;
+	int8_t j;
+	uint8_t len = rsa_get_len();
+
+	DPRINT("lucas\n");
+#ifdef RSA_GEN_DEBUG
+	debug_lucas_count++;
+#endif
+	for (p = 3;; p++) {
+		// n is perfect square or D has common factor with n
+		if (p == 255)
+			return 1;
+		j = rsa_jacobi((uint16_t) p * p - 4, n);
+		if (j == 0)
+			return 1;
+		if (j < 0)
+			break;
+	}
+	DPRINT("lucas P=%d\n", p);
+
+// d = (n + 1) / 2^s, n is odd: (n + 1) / 2 = (n >> 1) + 1
+	memset(exponent, 0, sizeof(rsa_exp_num));
+	memcpy(d, n, len);
+	rsa_shiftr(d);
+	memset(&two, 0, RSA_BYTES);
+	two.value[0] = 1;
+	rsa_add(d, &two);
+	s = 1;
+	while (!(d->value[0] & 1)) {
+		rsa_shiftr(d);
+		s++;
+	}
+
+// constants 2 and P, V(0) = 2, V(1) = P (Montgomery form)
+	lucas_const(&two, 2, t, n);
+	lucas_const(&pr, p, t, n);
+	memcpy(&v[0], &two, RSA_BYTES);
+	memcpy(&v[1], &pr, RSA_BYTES);
+
+	i = len * 8;
+	while (!(d->value[(i - 1) / 8] & (1 << ((i - 1) & 7))))
+		i--;
+	while (i--) {
+		bit = (d->value[i / 8] >> (i & 7)) & 1;
+		// V(k) * V(k+1) - P into v[bit ^ 1], V(k or k+1)^2 - 2 into v[bit]
+		lucas_mul(&v[bit ^ 1], &v[0], &v[1], t, n, Mc, Bc);
+		lucas_sub(&v[bit ^ 1], &pr, n);
+		lucas_mul(&v[bit], &v[bit], &v[bit], t, n, Mc, Bc);
+		lucas_sub(&v[bit], &two, n);
+	}
+// V(d) = 2 and V(d+1) = P, or V(d) = -2 and V(d+1) = -P
+	if (!memcmp(&v[0], &two, len) && !memcmp(&v[1], &pr, len))
+		goto lucas_prime;
+	memset(&t[0], 0, RSA_BYTES);
+	lucas_sub((rsa_num *) & t[0], &two, n);
+	if (!memcmp(&v[0], &t[0], len)) {
+		memset(&t[0], 0, RSA_BYTES);
+		lucas_sub((rsa_num *) & t[0], &pr, n);
+		if (!memcmp(&v[1], &t[0], len))
+			goto lucas_prime;
+	}
+// V(d * 2^r) = 0
+	while (--s) {
+		if (bn_is_zero(&v[0]))
+			goto lucas_prime;
+		lucas_mul(&v[0], &v[0], &v[0], t, n, Mc, Bc);
+		lucas_sub(&v[0], &two, n);
+	}
+	return 1;
+ lucas_prime:
+	memset(v, 0, sizeof(v));
+	return 0;
+}
 #endif
 
 // if some of code is not explained in comments, please check
@@ -1044,11 +1526,17 @@ static uint8_t __attribute__((noinline))
 	NPRINT("Mc=", &Mc, rsa_get_len() / 2);
 	NPRINT("Bc=", Bc, rsa_get_len());
 
+#ifdef RSA_BPSW
+// Baillie-PSW: base 2 test, (RSA_BPSW - 1) runs with random base, then
+// strong Lucas test
+	i = RSA_BPSW;
+#else
 // calculate number of loops (based on bit len of prime)
 // 3 runs for 1024 bit, 6 runs for 512, 12 runs for 256 bit ..
 	i = 0, count = bn_real_bit_len;
 	while (count <= 3072)
 		count += bn_real_bit_len, i++;
+#endif
 #ifdef RSA_GEN_DEBUG
 	debug_rm_count = 0;
 #endif
@@ -1058,8 +1546,15 @@ static uint8_t __attribute__((noinline))
 		// get random "a" in range <2 .. n-2>
 		// minimal "n" is 2^128+1, (rsa key 512) make "a" in range < (2^120)
 		memset(a, 0, RSA_BYTES);
-		rnd_get((uint8_t *) a, 15);	// 120 bits
-		a->value[0] |= 2;	// minimal value 2
+#ifdef RSA_BPSW
+		if (i == RSA_BPSW - 1)
+			a->value[0] = 2;	// 1st run, base 2
+		else
+#endif
+		{
+			rnd_get((uint8_t *) a, 15);	// 120 bits
+			a->value[0] |= 2;	// minimal value 2
+		}
 
 // do not use exponent blinding here ..
 #if E_BITS == 5
@@ -1126,8 +1621,12 @@ static uint8_t __attribute__((noinline))
 		goto mr_squaring_loop;
 // =======================================================================
 	}
+#ifdef RSA_BPSW
+	return lucas(n, &exponent, t, Bc, &Mc);
+#else
 // probably prime
 	return 0;
+#endif
 }
 
 // use GCD to test if n can be divided by small primes
@@ -1180,11 +1679,15 @@ uint8_t __attribute__((weak)) prime_gcd(rsa_num * p)
 #endif
 #endif
 // because small ram, here two free space pointer comes "t" and "tmp"
+// top - bits to set in highest byte of prime
 static void __attribute__((noinline))
-    get_prime(rsa_num * p, rsa_long_num t[2], rsa_long_num * tmp)
+    get_prime(rsa_num * p, rsa_long_num t[2], rsa_long_num * tmp, uint8_t top)
 {
 #ifdef RSA_GEN_DEBUG
 	int count_gcd = 0, count_rm = 0;
+#ifdef RSA_BPSW
+	debug_lucas_count = 0;
+#endif
 #endif
 
 	memset(p, 0, RSA_BYTES);
@@ -1192,7 +1695,7 @@ static void __attribute__((noinline))
 	rnd_get((uint8_t *) p, bn_real_byte_len);
 
 	p->value[0] |= 1;	// make number odd
-	p->value[bn_real_byte_len - 1] |= 0x80;	// make number big
+	p->value[bn_real_byte_len - 1] |= top;	// make number big
 #endif
 	DPRINT("get_prime\n");
 	for (;;) {
@@ -1204,7 +1707,7 @@ static void __attribute__((noinline))
 		rnd_get((uint8_t *) p, bn_real_byte_len);
 
 		p->value[0] |= 1;	// make number odd
-		p->value[bn_real_byte_len - 1] |= 0x80;	// make number big
+		p->value[bn_real_byte_len - 1] |= top;	// make number big
 #endif
 		if (!prime_gcd(p)) {
 #ifdef RSA_GEN_DEBUG
@@ -1228,7 +1731,13 @@ static void __attribute__((noinline))
 
 		f = fopen("rsa_gen_debug.stat", "a");
 		if (f != NULL) {
-			fprintf(f, "gcd %d miller-rabin %d\n0x", count_gcd, count_rm);
+// miller-rabin: runs for composites, final: runs for prime
+			fprintf(f, "gcd %d miller-rabin %d final %d", count_gcd, count_rm,
+				debug_rm_count);
+#ifdef RSA_BPSW
+			fprintf(f, " lucas %d", debug_lucas_count);
+#endif
+			fprintf(f, "\n0x");
 			for (i = bn_real_byte_len - 1; i >= 0; i--)
 				fprintf(f, "%02x", pr[i]);
 			fprintf(f, "\n");
@@ -1238,7 +1747,183 @@ static void __attribute__((noinline))
 #endif
 }
 
-uint8_t rsa_keygen(uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint16_t size)
+#ifdef RSA_CRT_SHORTCUT
+// x = e^-1 mod m for small e (below 2^24), m = p - 1 (even)
+// e * x = 1 + k * m, k = -m^-1 mod e, then x = (1 + k * m) / e
+// only short division and multiplication by small number is needed
+static uint8_t rsa_inv_small_e(rsa_num * x, uint32_t e, rsa_num * m)
+{
+	uint8_t len = rsa_get_len();
+	uint8_t i;
+	uint8_t tmp[RSA_BYTES + 4];
+	uint32_t r, k, carry;
+	int32_t a, b, q, x0, x1, t;
+
+	// r = m mod e
+	r = 0;
+	for (i = len; i > 0;) {
+		i--;
+		r = ((r << 8) | m->value[i]) % e;
+	}
+	// r^-1 mod e (extended Euclidean algorithm for small numbers)
+	a = e;
+	b = r;
+	x0 = 0;
+	x1 = 1;
+	while (b) {
+		q = a / b;
+		t = a - q * b;
+		a = b;
+		b = t;
+		t = x0 - q * x1;
+		x0 = x1;
+		x1 = t;
+	}
+	if (a != 1)
+		return 1;
+	if (x0 < 0)
+		x0 += e;
+	k = e - x0;
+
+	// tmp = 1 + k * m
+	carry = 1;
+	for (i = 0; i < len; i++) {
+		carry += k * m->value[i];
+		tmp[i] = carry;
+		carry >>= 8;
+	}
+	for (i = 0; i < 4; i++, carry >>= 8)
+		tmp[len + i] = carry;
+
+	// x = tmp / e (exact division, result is below m)
+	memset(x, 0, RSA_BYTES);
+	r = 0;
+	for (i = len + 4; i > 0;) {
+		i--;
+		r = (r << 8) | tmp[i];
+		if (i < len)
+			x->value[i] = r / e;
+		r %= e;
+	}
+	memset(tmp, 0, sizeof(tmp));
+	return 0;
+}
+
+// result = q^-1 mod p = q^(p-2) mod p (p is prime), Montgomery
+// exponentiation runs in constant time (does not depend on q)
+// return 1 if result is not inversion of q (p is not prime)
+static uint8_t __attribute__((noinline))
+    rsa_inv_mod_prime(rsa_num * result, rsa_num * q, rsa_num * p)
+{
+	rsa_exp_num exponent;
+	rsa_long_num t[2];
+	rsa_half_num Mc;
+	rsa_num Bc;
+	uint16_t count;
+	uint8_t len = rsa_get_len();
+	uint8_t ret;
+
+	// exponent = p - 2
+	memset(&exponent, 0, sizeof(rsa_exp_num));
+	memcpy(&exponent, p, len);
+	memset(&Bc, 0, RSA_BYTES);
+	Bc.value[0] = 2;
+	rsa_sub(&exponent.n, &exponent.n, &Bc);
+
+	count = rsaExpMod_montgomery_eblind(t, &exponent, p);
+	rsa_inv_mod_N(&Mc, p);
+	barrett_constant(&Bc, p);
+
+	memset(t, 0, RSA_BYTES * 4);
+// 1 * R mod p, q * R mod p
+	t[0].value[len / 2] = 1;
+	memcpy(&t[1].value[len / 2], q, len);
+	bn_mod_half(&t[1], p);
+
+	memset(result, 0, RSA_BYTES);
+	rsaExpMod_montgomery(result, &exponent, p, &Mc, &Bc, t, count, 0);
+
+	// check result * q mod p == 1
+	rsa_mul(&t[0], result, q);
+	partial_barret(&t[0], &Bc);
+	bn_mod_half(&t[0], p);
+	memset(&Bc, 0, RSA_BYTES);
+	Bc.value[0] = 1;
+	ret = memcmp(&t[0], &Bc, len) ? 1 : 0;
+	memset(&exponent, 0, sizeof(rsa_exp_num));
+	memset(t, 0, sizeof(t));
+	return ret;
+}
+#endif
+
+// calculate CRT components from P, Q and public exponent (in key->d)
+// bit length must be set to size of P, Q (bn_set_bitlen)
+// return 0 if OK, 1 if P, Q is even or inversion does not exist
+uint8_t rsa_crt_params(rsa_num * p, rsa_num * q, struct rsa_crt_key *key)
+{
+	uint8_t ret;
+#ifdef RSA_CRT_SHORTCUT
+	uint8_t i;
+	uint32_t e = 0;
+#endif
+
+	if (!(p->value[0] & q->value[0] & 1))
+		return 1;
+
+	//dP = (pub_exp^-1) mod (p-1)
+	//dQ = (pub_exp^-1) mod (q-1)
+	//qInv = q ^ -1  mod p
+	// subtract 1
+	p->value[0] &= 0xfe;
+	q->value[0] &= 0xfe;
+
+#ifdef RSA_CRT_SHORTCUT
+	// small public exponent (65537), short inversion
+	for (i = rsa_get_len(); i > 3; i--)
+		if (key->d.value[i - 1])
+			break;
+	if (i == 3)
+		e = key->d.value[0] | (uint16_t) key->d.value[1] << 8 |
+		    (uint32_t) key->d.value[2] << 16;
+	if ((e & 1) && e > 1) {
+		ret = rsa_inv_small_e(&(key->dP), e, p);
+		if (!ret)
+			ret = rsa_inv_small_e(&(key->dQ), e, q);
+	} else
+#endif
+	{
+		ret = rsa_inv_mod(&(key->dP), &(key->d), p);
+		if (!ret)
+			ret = rsa_inv_mod(&(key->dQ), &(key->d), q);
+	}
+	// add 1 back
+	p->value[0] |= 1;
+	q->value[0] |= 1;
+
+#ifdef RSA_CRT_SHORTCUT
+	if (!ret)
+		ret = rsa_inv_mod_prime(&(key->qInv), q, p);
+#else
+	if (!ret)
+		ret = rsa_inv_mod(&(key->qInv), q, p);
+#endif
+	return ret;
+}
+
+#ifdef RSA_PRIME_POOL
+// generate prime for pool, size in bytes (half of modulus), two highest bits
+// are set, modulus from two pooled primes has always highest bit set
+void rsa_pool_prime(rsa_num * p, struct rsa_crt_key *key, rsa_long_num * tmp, uint8_t size)
+{
+	bn_set_bitlen(size * 8);
+	get_prime(p, key->t, tmp, 0xc0);
+}
+#endif
+
+// pool != 0: P, Q in message are already generated (prime pool), P, Q are
+// used in 1st round, if P, Q does not match criteria, new P, Q are generated
+uint8_t rsa_keygen(uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint16_t size,
+		   uint8_t pool)
 {
 	rsa_num *p = (rsa_num *) message;
 	rsa_num *q = (rsa_num *) (message + 128);
@@ -1250,8 +1935,11 @@ uint8_t rsa_keygen(uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint
 
 	bn_set_bitlen(size / 2);
 	for (;;) {
-		get_prime(p, key->t, modulus);
-		get_prime(q, key->t, modulus);
+		if (!pool) {
+			get_prime(p, key->t, modulus, 0x80);
+			get_prime(q, key->t, modulus, 0x80);
+		}
+		pool = 0;
 
 // test P,Q, if P < Q swap P and Q
 		if (bn_abs_sub(modulus, p, q))
@@ -1304,23 +1992,7 @@ uint8_t rsa_keygen(uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint
 		NPRINT("modulus=", modulus, rsa_get_len() * 2);
 		NPRINT("d=", &key->d, rsa_get_len());
 
-		//dP = (pub_exp^-1) mod (p-1)
-		//dQ = (pub_exp^-1) mod (q-1)
-		//qInv = q ^ -1  mod p
-		// subtract 1
-		p->value[0] &= 0xfe;
-		q->value[0] &= 0xfe;
-
-		if (rsa_inv_mod(&(key->dP), &(key->d), p))
-			continue;
-
-		if (rsa_inv_mod(&(key->dQ), &(key->d), q))
-			continue;
-		// add 1 back
-		p->value[0] |= 1;
-		q->value[0] |= 1;
-
-		if (rsa_inv_mod(&(key->qInv), q, p))
+		if (rsa_crt_params(p, q, key))
 			continue;
 		break;
 	}
@@ -1330,3 +2002,96 @@ uint8_t rsa_keygen(uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint
 	NPRINT("qInv=", &key->qInv, rsa_get_len());
 	return size / 16;
 }
+
+#ifdef RSA_MULTI_PRIME
+// test if |a - b| < 2 pow (8 * bytes - 100), bytes = size of bigger prime
+static uint8_t rsa_primes_close(rsa_long_num * tmp, rsa_num * a, rsa_num * b, uint8_t bytes)
+{
+	uint8_t *test = &tmp->value[bytes - 1];
+	uint8_t t = 13;		// 104 bits
+
+	bn_abs_sub(tmp, a, b);
+	do {
+		if (*test-- != 0)
+			return 0;
+	}
+	while (--t);
+	return 1;
+}
+
+// three prime key (RFC 8017 multi-prime), size of primes: RSA_MP_PQ_PART,
+// RSA_MP_R_PART, P and Q are returned in message (same as in rsa_keygen()),
+// R, dR, tR in "mp", dP, dQ, qInv in "key", modulus in "r".
+// Return size of P, Q parts
+uint8_t rsa_keygen_mp(uint8_t * message, uint8_t * r, struct rsa_crt_key *key,
+		      struct rsa_mp_key *mp, uint16_t size)
+{
+	rsa_num *p = (rsa_num *) message;
+	rsa_num *q = (rsa_num *) (message + 128);
+	rsa_long_num *modulus = (rsa_long_num *) r;
+// P * Q is stored in space for dR, tR (not yet calculated)
+	rsa_long_num *pq = (rsa_long_num *) & mp->dR;
+	uint16_t bytes = size / 8;
+	uint8_t pq_bytes = RSA_MP_PQ_PART(bytes);
+	uint8_t r_bytes = RSA_MP_R_PART(bytes);
+	uint8_t ret;
+
+	for (;;) {
+// two highest bits of all primes are set, then modulus of
+// requested size can be always reached by new R
+		bn_set_bitlen(pq_bytes * 8);
+		get_prime(p, key->t, modulus, 0xc0);
+		get_prime(q, key->t, modulus, 0xc0);
+		if (rsa_primes_close(modulus, p, q, pq_bytes))
+			continue;
+		rsa_mul(pq, p, q);
+		for (;;) {
+			bn_set_bitlen(r_bytes * 8);
+			get_prime(&mp->r, key->t, modulus, 0xc0);
+			if (r_bytes == pq_bytes) {
+				if (rsa_primes_close(modulus, p, &mp->r, r_bytes))
+					continue;
+				if (rsa_primes_close(modulus, q, &mp->r, r_bytes))
+					continue;
+			}
+// R is not longer than P, Q
+			bn_set_bitlen(pq_bytes * 8);
+			memset(modulus, 0, rsa_get_len() * 2);
+			rsa_mul_add_long(r, &mp->r, pq, &key->t[0], bytes);
+			if (modulus->value[bytes - 1] & 0x80)
+				break;
+		}
+		NPRINT("P=", p, pq_bytes);
+		NPRINT("Q=", q, pq_bytes);
+		NPRINT("R=", &mp->r, r_bytes);
+		NPRINT("modulus=", modulus, bytes);
+
+// tR = (P * Q)^-1 mod R, (Bc for R in key->t[1])
+		bn_set_bitlen(r_bytes * 8);
+		barrett_constant(&key->t[1].L, &mp->r);
+		rsa_mod_message(&key->t[0], pq->value, pq_bytes * 2, &mp->r, &key->t[1].L);
+		if (rsa_inv_mod(&mp->tR, &key->t[0].L, &mp->r))
+			continue;
+
+// public exponent
+//#warning, fixed public exponent
+		memset(&(key->d), 0, RSA_BYTES);
+		key->d.value[0] = 1;
+		key->d.value[2] = 1;
+
+		//dR = (pub_exp^-1) mod (r-1)
+		mp->r.value[0] &= 0xfe;
+		ret = rsa_inv_mod(&mp->dR, &key->d, &mp->r);
+		mp->r.value[0] |= 1;
+		if (ret)
+			continue;
+
+		bn_set_bitlen(pq_bytes * 8);
+		if (!rsa_crt_params(p, q, key))
+			break;
+	}
+	NPRINT("dR=", &mp->dR, r_bytes);
+	NPRINT("tR=", &mp->tR, r_bytes);
+	return pq_bytes;
+}
+#endif
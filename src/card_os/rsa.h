@@ -109,9 +109,39 @@ struct rsa_crt_key
 
 
 
+#ifdef RSA_MULTI_PRIME
+// three prime key (RFC 8017 multi-prime), additional prime r,
+// exponent dR and CRT coefficient tR = (p*q)^-1 mod r
+struct rsa_mp_key
+{
+  rsa_num r;
+  rsa_num dR;
+  rsa_num tR;
+};
+
+// Arithmetic needs a modulus with highest bit set in one of available
+// lengths (32,48,64,96,128 bytes), primes are not of equal size:
+// R is 1/3 of modulus rounded down to 32 bytes, P and Q share the rest
+// (1536: 512*3, 2048: 768+768+512)
+#define RSA_MP_R_PART(bytes) (((bytes) / 3) & ~31)
+#define RSA_MP_PQ_PART(bytes) (((bytes) - RSA_MP_R_PART(bytes)) / 2)
+// below 1536 bits the smallest prime is 256 bits only (768: 256*3, 1024:
+// 384+384+256), in reach of ECM factoring, three prime key is not allowed
+#define RSA_MP_MIN_BITS 1536
+#endif
+
 uint8_t rsa_calculate (uint8_t * data, uint8_t * result, uint16_t size);
-uint8_t rsa_keygen (uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint16_t size);
-uint8_t rsa_modulus(void *m);
+uint8_t rsa_keygen (uint8_t * message, uint8_t * r, struct rsa_crt_key *key, uint16_t size,
+		    uint8_t pool);
+#ifdef RSA_PRIME_POOL
+void rsa_pool_prime (rsa_num * p, struct rsa_crt_key *key, rsa_long_num * tmp, uint8_t size);
+#endif
+uint8_t rsa_crt_params (rsa_num * p, rsa_num * q, struct rsa_crt_key *key);
+uint8_t rsa_modulus(void *m, uint16_t size);
+#ifdef RSA_MULTI_PRIME
+uint8_t rsa_keygen_mp (uint8_t * message, uint8_t * r, struct rsa_crt_key *key,
+		       struct rsa_mp_key *mp, uint16_t size);
+#endif
 
 #ifdef USE_P_Q_INV
 void rsa_inv_mod_N (rsa_half_num * n_, rsa_num * modulus);
@@ -140,6 +170,10 @@ void barrett_constant(rsa_num * Bc, rsa_num * modulus);
 #define Re_Q_GET_FAIL_2		243
 #define Re_R_Single_Error	244
 #define Re_Q_Single_Error	245
+#define Re_R3_GET_FAIL_1	246
+#define Re_dR_1			247
+#define Re_tR_GET_FAIL_1	248
+#define Re_R3_Single_Error	249
 #else
 // error codes (normal)
 #define Re_DATA_RESULT_SAME 	1
@@ -158,6 +192,10 @@ void barrett_constant(rsa_num * Bc, rsa_num * modulus);
 #define Re_Q_GET_FAIL_2		1
 #define Re_R_Single_Error	1
 #define Re_Q_Single_Error	1
+#define Re_R3_GET_FAIL_1	1
+#define Re_dR_1			1
+#define Re_tR_GET_FAIL_1	1
+#define Re_R3_Single_Error	1
 #endif
 
 #endif
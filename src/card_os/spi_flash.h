@@ -0,0 +1,77 @@
+/*
+    spi_flash.h
+
+    This is part of OsEID (Open source Electronic ID)
+
+    Copyright (C) 2015-2023 Peter Popovec, popovec.peter@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    external SPI NOR flash (25xx series) for filesystem, header file
+
+*/
+
+/****************************************************************
+
+The filesystem (device_read_block, device_write_block, device_write_ff,
+device_format) is placed in external SPI NOR flash if MEM_DEVICE_SPI_FLASH
+is defined.  sec_device_* functions and the change counter are still
+provided by the target mem_device code (internal EEPROM/file).
+
+****************************************************************/
+
+// NOR flash geometry (common 25xx devices, 256 bytes page, 4kiB sector)
+#define SPI_FLASH_PAGE		256
+#define SPI_FLASH_SECTOR	4096
+
+// filesystem start in SPI flash (must be sector aligned)
+#ifndef SPI_FLASH_BASE
+#define SPI_FLASH_BASE		0
+#endif
+// SPI_FLASH_SPARES sectors after filesystem are used (in rotation) as
+// temporary buffer for sector rewrite, next sector holds tag records for
+// power fail recovery (minimal flash size is SPI_FLASH_BASE + 64kiB +
+// (SPI_FLASH_SPARES + 1) * 4kiB)
+#ifndef SPI_FLASH_SPARES
+#define SPI_FLASH_SPARES	8
+#endif
+#define SPI_FLASH_SPARE		(SPI_FLASH_BASE + 0x10000UL)
+#define SPI_FLASH_TAG		(SPI_FLASH_SPARE + SPI_FLASH_SPARES * SPI_FLASH_SECTOR)
+
+// NOR flash commands
+#define SPI_FLASH_CMD_WRSR	0x01
+#define SPI_FLASH_CMD_PP	0x02
+#define SPI_FLASH_CMD_READ	0x03
+#define SPI_FLASH_CMD_RDSR	0x05
+#define SPI_FLASH_CMD_WREN	0x06
+#define SPI_FLASH_CMD_SE	0x20
+#define SPI_FLASH_CMD_RDID	0x9f
+
+// status register bits
+#define SPI_FLASH_SR_WIP	1
+#define SPI_FLASH_SR_WEL	2
+
+/****************************************************************
+
+SPI transport, provided by target (AVR128DA: SPI1 peripheral, console:
+flash model in file)
+
+****************************************************************/
+void spi_flash_init(void);
+void spi_flash_select(void);
+void spi_flash_deselect(void);
+uint8_t spi_flash_xfer(uint8_t data);
+
+// provided by target mem_device code, called after each filesystem change
+void device_update_change_counter(void);
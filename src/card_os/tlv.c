@@ -0,0 +1,105 @@
+/*
+    tlv.c
+
+    This is part of OsEID (Open source Electronic ID)
+
+    Copyright (C) 2015-2023 Peter Popovec, popovec.peter@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    zero copy BER-TLV iterator
+
+    Data are parsed in place (APDU buffer), value of TLV is available as
+    pointer into buffer. Structure of TLV is checked - value must not
+    overrun parent TLV or end of buffer.
+
+*/
+#define DEBUG_TLV
+#include "debug.h"
+
+#include <stdint.h>
+#include "tlv.h"
+
+void tlv_init(struct tlv *t, uint8_t * data, uint16_t len)
+{
+	t->data = data;
+	t->len = len;
+	t->padding = 1;
+}
+
+void tlv_enter(struct tlv *inner, struct tlv *outer)
+{
+	tlv_init(inner, outer->value, outer->tag_len);
+	// no padding inside constructed data object
+	inner->padding = 0;
+}
+
+uint8_t tlv_next(struct tlv *t)
+{
+	uint8_t *data = t->data;
+	uint16_t len = t->len;
+	uint16_t tag_len;
+	uint8_t l;
+
+	// skip padding (top level only)
+	for (;;) {
+		if (!len)
+			return TLV_END;
+		if (!t->padding || (*data != 0 && *data != 0xff))
+			break;
+		data++;
+		len--;
+	}
+	t->tag = *data++;
+	len--;
+	if ((t->tag & 0x1f) == 0x1f) {
+		DPRINT("TLV, multibyte tag %02x\n", t->tag);
+		return TLV_ERROR;
+	}
+	if (!len)
+		return TLV_ERROR;
+	tag_len = *data++;
+	len--;
+	if (tag_len & 0x80) {
+		// 0x81 one byte, 0x82 two bytes
+		l = tag_len & 0x7f;
+		if (l == 0 || l > 2 || len < l) {
+			DPRINT("TLV, wrong length encoding %02x\n", tag_len);
+			return TLV_ERROR;
+		}
+		tag_len = 0;
+		while (l--) {
+			tag_len = (tag_len << 8) | *data++;
+			len--;
+		}
+	}
+	if (len < tag_len) {
+		DPRINT("TLV, tag %02x length %d, only %d bytes in buffer\n", t->tag, tag_len, len);
+		return TLV_ERROR;
+	}
+	t->tag_len = tag_len;
+	t->value = data;
+	t->data = data + tag_len;
+	t->len = len - tag_len;
+	return TLV_OK;
+}
+
+uint16_t tlv_expect(struct tlv *t, uint8_t tag)
+{
+	if (tlv_next(t) != TLV_OK)
+		return 0xffff;
+	if (t->tag != tag)
+		return 0xffff;
+	return t->tag_len;
+}
@@ -0,0 +1,52 @@
+/*
+    tlv.h
+
+    This is part of OsEID (Open source Electronic ID)
+
+    Copyright (C) 2015-2023 Peter Popovec, popovec.peter@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    zero copy BER-TLV iterator (APDU data field), header file
+
+*/
+#ifndef CS_TLV_H
+#define CS_TLV_H
+
+// only one byte tags are supported (tag number 0x1f - multibyte tag is
+// reported as error), length in short form or 0x81, 0x82 long form.
+
+struct tlv {
+	uint8_t *data;		// next TLV
+	uint16_t len;		// remaining bytes in data
+	uint8_t padding;	// skip 0x00/0xff padding (top level only)
+	uint8_t tag;		// current TLV
+	uint16_t tag_len;
+	uint8_t *value;
+};
+
+#define TLV_OK		0
+#define TLV_END		1
+#define TLV_ERROR	2
+
+void tlv_init(struct tlv *t, uint8_t * data, uint16_t len);
+// iterate over value of current TLV (constructed data object)
+void tlv_enter(struct tlv *inner, struct tlv *outer);
+// return TLV_OK, TLV_END or TLV_ERROR, padding bytes (0x00, 0xff) are
+// skipped at top level (not in TLV entered by tlv_enter())
+uint8_t tlv_next(struct tlv *t);
+// next TLV must match tag, return value length or 0xffff
+uint16_t tlv_expect(struct tlv *t, uint8_t tag);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+    mem_device_spi.c
+
+    This is part of OsEID (Open source Electronic ID)
+
+    Copyright (C) 2015-2023 Peter Popovec, popovec.peter@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    mem device driver for filesystem in external SPI NOR flash
+
+    Reads are done as one burst (one READ command per call, data are
+    transferred directly into caller buffer).  Writes are checked against
+    flash content, if no bit needs to be changed from 0 to 1, data are
+    written by PAGE PROGRAM command (one command per flash page).  Otherwise
+    the whole sector is merged with new data into spare sector, then the
+    sector is erased and restored from spare sector.  Only one page buffer
+    (256 bytes, on stack) is needed.  Spare sectors are used in rotation
+    (SPI_FLASH_SPARES), each spare is erased only once per SPI_FLASH_SPARES
+    rewrites.
+
+    Power fail safety: after the spare sector is written, a tag record
+    (sector number, inverted sector number, state) is programmed into the
+    tag sector, after restore the record is cleared to zero.  At start, a
+    record in state "spare valid" means that the restore was interrupted,
+    the sector is restored again from spare sector.  Records are appended,
+    the tag sector is erased when it is full (1024 rewrites).  The spare
+    sector is selected by the position of tag record.
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include "mem_device.h"
+#include "spi_flash.h"
+
+#if 0
+#include <stdio.h>
+#define  DPRINT(msg...) fprintf(stderr,msg)
+#else
+#define DPRINT(msg...)
+#endif
+
+#define FS_SIZE 0x10000UL
+
+// tag record: sector number, inverted sector number, state, 0xff
+#define SPI_FLASH_TAG_REC	4
+#define SPI_FLASH_TAG_VALID	0x55
+
+// after tag sector erase the rotation continues with the 1st spare sector
+#if (SPI_FLASH_SECTOR / SPI_FLASH_TAG_REC) % SPI_FLASH_SPARES
+#error SPI_FLASH_SPARES must divide number of tag records
+#endif
+
+static uint8_t spi_flash_initialized;
+// offset of free tag record in tag sector (SPI_FLASH_SECTOR = erase needed)
+static uint16_t spi_flash_tag_pos;
+
+static void spi_flash_command(uint8_t cmd, uint32_t address)
+{
+	spi_flash_select();
+	spi_flash_xfer(cmd);
+	spi_flash_xfer(address >> 16);
+	spi_flash_xfer(address >> 8);
+	spi_flash_xfer(address);
+}
+
+static void spi_flash_wait(void)
+{
+	spi_flash_select();
+	spi_flash_xfer(SPI_FLASH_CMD_RDSR);
+	while (spi_flash_xfer(0xff) & SPI_FLASH_SR_WIP) ;
+	spi_flash_deselect();
+}
+
+static void spi_flash_write_enable(void)
+{
+	spi_flash_select();
+	spi_flash_xfer(SPI_FLASH_CMD_WREN);
+	spi_flash_deselect();
+}
+
+static void spi_flash_read(uint8_t * buffer, uint32_t address, uint16_t size)
+{
+	spi_flash_command(SPI_FLASH_CMD_READ, address);
+	while (size--)
+		*buffer++ = spi_flash_xfer(0xff);
+	spi_flash_deselect();
+}
+
+// data == NULL - program 0xff (this is used only for erased flash, no change)
+// size must not cross page boundary
+static void spi_flash_program(uint8_t * data, uint32_t address, uint16_t size)
+{
+	if (!data)
+		return;
+	spi_flash_write_enable();
+	spi_flash_command(SPI_FLASH_CMD_PP, address);
+	while (size--)
+		spi_flash_xfer(*data++);
+	spi_flash_deselect();
+	spi_flash_wait();
+}
+
+static void spi_flash_erase(uint32_t address)
+{
+	spi_flash_write_enable();
+	spi_flash_command(SPI_FLASH_CMD_SE, address);
+	spi_flash_deselect();
+	spi_flash_wait();
+}
+
+// return 0 if flash already contain data, 1 if programming is enough, 2 if erase is needed
+static uint8_t spi_flash_compare(uint8_t * data, uint32_t address, uint16_t size)
+{
+	uint8_t old, new;
+	uint8_t ret = 0;
+
+	spi_flash_command(SPI_FLASH_CMD_READ, address);
+	while (size--) {
+		old = spi_flash_xfer(0xff);
+		new = data ? *data++ : 0xff;
+		if (old != new) {
+			ret = 1;
+			if ((old & new) != new) {
+				ret = 2;
+				break;
+			}
+		}
+	}
+	spi_flash_deselect();
+	return ret;
+}
+
+// program area inside one sector, page by page
+static void spi_flash_program_area(uint8_t * data, uint32_t address, uint16_t size)
+{
+	uint16_t len;
+
+	while (size) {
+		len = SPI_FLASH_PAGE - (address & (SPI_FLASH_PAGE - 1));
+		if (len > size)
+			len = size;
+		spi_flash_program(data, address, len);
+		if (data)
+			data += len;
+		address += len;
+		size -= len;
+	}
+}
+
+// spare sector for tag record at position "pos"
+static uint32_t spi_flash_spare(uint16_t pos)
+{
+	return SPI_FLASH_SPARE +
+	    (uint32_t) ((pos / SPI_FLASH_TAG_REC) % SPI_FLASH_SPARES) * SPI_FLASH_SECTOR;
+}
+
+// erase sector and copy spare sector into it (skip empty pages)
+static void spi_flash_restore(uint32_t sector, uint32_t spare)
+{
+	uint8_t page[SPI_FLASH_PAGE];
+	uint16_t i, p;
+
+	spi_flash_erase(sector);
+	for (p = 0; p < SPI_FLASH_SECTOR; p += SPI_FLASH_PAGE) {
+		spi_flash_read(page, spare + p, SPI_FLASH_PAGE);
+		for (i = 0; i < SPI_FLASH_PAGE; i++)
+			if (page[i] != 0xff)
+				break;
+		if (i != SPI_FLASH_PAGE)
+			spi_flash_program(page, sector + p, SPI_FLASH_PAGE);
+	}
+}
+
+// spare sector is complete, write tag record for "sector"
+static void spi_flash_tag_set(uint32_t sector)
+{
+	uint8_t rec[3];
+
+	rec[0] = (sector - SPI_FLASH_BASE) / SPI_FLASH_SECTOR;
+	rec[1] = ~rec[0];
+	rec[2] = SPI_FLASH_TAG_VALID;
+	// state is programmed after sector number, partially programmed
+	// record is never valid
+	spi_flash_program(rec, SPI_FLASH_TAG + spi_flash_tag_pos, 2);
+	spi_flash_program(rec + 2, SPI_FLASH_TAG + spi_flash_tag_pos + 2, 1);
+}
+
+// sector is restored, clear tag record
+static void spi_flash_tag_clear(void)
+{
+	uint8_t rec[SPI_FLASH_TAG_REC] = { 0 };
+
+	spi_flash_program(rec, SPI_FLASH_TAG + spi_flash_tag_pos, SPI_FLASH_TAG_REC);
+	spi_flash_tag_pos += SPI_FLASH_TAG_REC;
+}
+
+// find free tag record, finish interrupted sector rewrite
+static void spi_flash_tag_scan(void)
+{
+	uint8_t rec[SPI_FLASH_TAG_REC];
+	uint16_t pos, free, valid;
+
+	free = valid = SPI_FLASH_SECTOR;
+	for (pos = 0; pos < SPI_FLASH_SECTOR; pos += SPI_FLASH_TAG_REC) {
+		spi_flash_read(rec, SPI_FLASH_TAG + pos, SPI_FLASH_TAG_REC);
+		if ((rec[0] & rec[1] & rec[2] & rec[3]) == 0xff) {
+			if (free == SPI_FLASH_SECTOR)
+				free = pos;
+			continue;
+		}
+		// data behind free record - interrupted erase of tag sector (no
+		// rewrite is pending), erase tag sector before next use
+		if (free != SPI_FLASH_SECTOR) {
+			free = valid = SPI_FLASH_SECTOR;
+			break;
+		}
+		// only the last used record can be valid
+		valid = SPI_FLASH_SECTOR;
+		if (rec[2] == SPI_FLASH_TAG_VALID && rec[3] == 0xff &&
+		    (uint8_t) (rec[0] ^ rec[1]) == 0xff && rec[0] < FS_SIZE / SPI_FLASH_SECTOR)
+			valid = pos;
+	}
+	spi_flash_tag_pos = free;
+	if (valid != SPI_FLASH_SECTOR) {
+		spi_flash_read(rec, SPI_FLASH_TAG + valid, 1);
+		DPRINT("SPI flash restoring sector %02x\n", rec[0]);
+		spi_flash_restore(SPI_FLASH_BASE + (uint32_t) rec[0] * SPI_FLASH_SECTOR,
+				  spi_flash_spare(valid));
+		spi_flash_tag_pos = valid;
+		spi_flash_tag_clear();
+	}
+}
+
+static void spi_flash_check_init(void)
+{
+	if (spi_flash_initialized)
+		return;
+	spi_flash_init();
+	// clear block protection bits
+	spi_flash_write_enable();
+	spi_flash_select();
+	spi_flash_xfer(SPI_FLASH_CMD_WRSR);
+	spi_flash_xfer(0);
+	spi_flash_deselect();
+	spi_flash_wait();
+	spi_flash_tag_scan();
+	spi_flash_initialized = 1;
+}
+
+// merge sector at "sector" with new data (start, size), use spare sector
+static void spi_flash_sector_rewrite(uint8_t * data, uint32_t start, uint16_t size,
+				     uint32_t sector)
+{
+	uint8_t page[SPI_FLASH_PAGE];
+	uint16_t i, p;
+	uint32_t address, spare;
+
+	DPRINT("SPI flash sector rewrite %06lx\n", (unsigned long)sector);
+
+	// no rewrite is pending, tag sector can be erased
+	if (spi_flash_tag_pos >= SPI_FLASH_SECTOR) {
+		spi_flash_erase(SPI_FLASH_TAG);
+		spi_flash_tag_pos = 0;
+	}
+	spare = spi_flash_spare(spi_flash_tag_pos);
+	spi_flash_erase(spare);
+	for (p = 0; p < SPI_FLASH_SECTOR; p += SPI_FLASH_PAGE) {
+		address = sector + p;
+		spi_flash_read(page, address, SPI_FLASH_PAGE);
+		for (i = 0; i < SPI_FLASH_PAGE; i++, address++)
+			if (address >= start && address < start + size)
+				page[i] = data ? data[address - start] : 0xff;
+		spi_flash_program(page, spare + p, SPI_FLASH_PAGE);
+	}
+	spi_flash_tag_set(sector);
+	spi_flash_restore(sector, spare);
+	spi_flash_tag_clear();
+}
+
+static uint8_t spi_flash_update(uint8_t * data, uint16_t offset, uint8_t size)
+{
+	uint32_t address, sector;
+	uint16_t s, len;
+
+	s = size ? size : 256;
+	if ((uint32_t) offset + s > FS_SIZE)
+		return 1;
+
+	spi_flash_check_init();
+	address = SPI_FLASH_BASE + offset;
+
+	while (s) {
+		sector = address & ~(uint32_t) (SPI_FLASH_SECTOR - 1);
+		len = sector + SPI_FLASH_SECTOR - address;
+		if (len > s)
+			len = s;
+		switch (spi_flash_compare(data, address, len)) {
+		case 1:
+			spi_flash_program_area(data, address, len);
+			break;
+		case 2:
+			spi_flash_sector_rewrite(data, address, len, sector);
+			break;
+		}
+		if (data)
+			data += len;
+		address += len;
+		s -= len;
+	}
+	device_update_change_counter();
+	return 0;
+}
+
+// size 0 is interpreted as 256!
+uint8_t device_read_block(void *buffer, uint16_t offset, uint8_t size)
+{
+	uint16_t s;
+
+	s = size ? size : 256;
+	if ((uint32_t) offset + s > FS_SIZE)
+		return 1;
+
+	spi_flash_check_init();
+	spi_flash_read(buffer, SPI_FLASH_BASE + offset, s);
+	return 0;
+}
+
+// size 0 is interpreted as 256!
+uint8_t device_write_block(void *buffer, uint16_t offset, uint8_t size)
+{
+	return spi_flash_update(buffer, offset, size);
+}
+
+// fill block at offset _offset_ with value 0xff
+uint8_t device_write_ff(uint16_t offset, uint8_t size)
+{
+	return spi_flash_update(NULL, offset, size);
+}
+
+uint8_t device_format(void)
+{
+	uint32_t address;
+
+	spi_flash_check_init();
+	for (address = 0; address < FS_SIZE; address += SPI_FLASH_SECTOR)
+		spi_flash_erase(SPI_FLASH_BASE + address);
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+    spi_flash.c
+
+    This is part of OsEID (Open source Electronic ID)
+
+    Copyright (C) 2020-2023 Peter Popovec, popovec.peter@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    AVR128DA SPI transport for external SPI NOR flash
+
+    SPI1 (default pin position), PORTA is used by card IO
+    PC0 - MOSI
+    PC1 - MISO
+    PC2 - SCK
+    PC3 - flash chip select (GPIO, SPI SS pin is disabled)
+
+*/
+#include <stdint.h>
+#include "spi_flash.h"
+
+// define register position,  AVR128DA is new device, lot of people does not have gcc include file for this CPU
+#define l_PORTC 0x440
+#define l_SPI1	0x960
+
+#define PORT_DIRSET	1
+#define PORT_OUTSET	5
+#define PORT_OUTCLR	6
+
+#define SPI_CTRLA	0
+#define SPI_CTRLB	1
+#define SPI_INTFLAGS	3
+#define SPI_DATA	4
+
+void spi_flash_init(void)
+{
+	volatile uint8_t *port = (uint8_t *) l_PORTC;
+	volatile uint8_t *spi = (uint8_t *) l_SPI1;
+
+	// CS high, then MOSI, SCK, CS as output
+	port[PORT_OUTSET] = 8;
+	port[PORT_DIRSET] = 1 | 4 | 8;
+	// SSD - slave select disable, mode 0
+	spi[SPI_CTRLB] = 4;
+	// master, CLK2X, prescaler 4 (CPU clock / 2), enable
+	spi[SPI_CTRLA] = 0x31;
+}
+
+void spi_flash_select(void)
+{
+	volatile uint8_t *port = (uint8_t *) l_PORTC;
+
+	port[PORT_OUTCLR] = 8;
+}
+
+void spi_flash_deselect(void)
+{
+	volatile uint8_t *port = (uint8_t *) l_PORTC;
+
+	port[PORT_OUTSET] = 8;
+}
+
+uint8_t spi_flash_xfer(uint8_t data)
+{
+	volatile uint8_t *spi = (uint8_t *) l_SPI1;
+
+	spi[SPI_DATA] = data;
+	// wait for IF
+	while (!(spi[SPI_INTFLAGS] & 0x80)) ;
+	return spi[SPI_DATA];
+}
@@ -128,6 +128,18 @@ device_init (void)
     }
   initialized = 1;
   close (f);
+#ifdef FS_SESSION_SIZE
+  // image created without session objects may contain files in memory
+  // mapped to session objects (these files are not accessible)
+  for (size = 0x10000 - FS_SESSION_SIZE; size < MEMSIZE; size++)
+    if (mem[size] != 0xff)
+      {
+	fprintf (stderr,
+		 "card_mem: filesystem is over %d bytes limit, erase card\n",
+		 0x10000 - FS_SESSION_SIZE);
+	break;
+      }
+#endif
   return 0;
 }
 
@@ -143,6 +155,14 @@ static void update_change_counter(void){
 	change_counter[1] = c >> 8;
 }
 
+#ifdef MEM_DEVICE_SPI_FLASH
+// filesystem is in SPI flash (lib/generic/mem_device_spi.c)
+void device_update_change_counter(void){
+	update_change_counter();
+	device_writeback ();
+}
+#endif
+
 uint16_t device_get_change_counter(){
 	return change_counter[0] | ((uint16_t)change_counter[1] << 8);
 }
@@ -189,6 +209,7 @@ sec_device_write_block (void *buffer, uint16_t offset, uint8_t size)
   return 0;
 }
 
+#ifndef MEM_DEVICE_SPI_FLASH
 // size 0 is interpreted as 256!
 uint8_t
 device_read_block (void *buffer, uint16_t offset, uint8_t size)
@@ -266,6 +287,7 @@ uint8_t device_format()
 		return -1;
 	return 0;
 }
+#endif
 
 uint8_t sec_device_format()
 {
@@ -93,9 +93,19 @@ alt:
 #include <stdlib.h>
 #include "serial.h"
 
-static uint8_t cached_atr[MAX_ATR_SIZE];
-static uint8_t cached_atr_len = 0;
-static uint8_t proto;
+// per reader state (reader index from Lun)
+static struct
+{
+  uint8_t cached_atr[MAX_ATR_SIZE];
+  uint8_t cached_atr_len;
+  uint8_t proto;
+  uint8_t first_run;
+} readers[OsEIDsim_MAX_READERS];
+
+#define cached_atr readers[LunToReader (Lun)].cached_atr
+#define cached_atr_len readers[LunToReader (Lun)].cached_atr_len
+#define proto readers[LunToReader (Lun)].proto
+#define first_run readers[LunToReader (Lun)].first_run
 
 int hex2bytes (char *from, int size, uint8_t * to);
 /* Helper for parsing string to hex and back */
@@ -118,7 +128,7 @@ IFDHCreateChannelByName (DWORD Lun, LPSTR lpcDevice)
 {
   Log3 (PCSC_LOG_INFO, "lun: %" PRIx64 ", device: %s", Lun, lpcDevice);
 
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 
   Log1 (PCSC_LOG_INFO, "opening port");
@@ -136,7 +146,7 @@ IFDHCreateChannel (DWORD Lun, DWORD Channel)
 {
   RESPONSECODE return_value = IFD_SUCCESS;
 
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 
 
@@ -152,7 +162,7 @@ IFDHCreateChannel (DWORD Lun, DWORD Channel)
 RESPONSECODE
 IFDHCloseChannel (DWORD Lun)
 {
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 
   ClosePort (Lun);
@@ -162,7 +172,7 @@ IFDHCloseChannel (DWORD Lun)
 RESPONSECODE
 IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
 {
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 
   switch (Tag)
@@ -185,7 +195,7 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
       log_xxd (PCSC_LOG_DEBUG, "ATR cached: ", Value, *Length);
       break;
 
-// only one reader, only one slot only one simult. access
+// one slot per reader, only one simult. access
     case TAG_IFD_SIMULTANEOUS_ACCESS:
     case TAG_IFD_SLOTS_NUMBER:
     case TAG_IFD_SLOT_THREAD_SAFE:
@@ -209,7 +219,7 @@ RESPONSECODE
 IFDHSetCapabilities (DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
 {
   // ignore this (only used in IFDHandler v1.0)
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
   return IFD_SUCCESS;
 }
@@ -222,7 +232,7 @@ IFDHSetProtocolParameters (DWORD Lun, DWORD Protocol,
   uint8_t buffer[10];
   DWORD blen = 10;
 
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 
   if (Protocol == SCARD_PROTOCOL_T0)
@@ -260,8 +270,7 @@ IFDHSetProtocolParameters (DWORD Lun, DWORD Protocol,
 RESPONSECODE
 IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 {
-  static uint8_t first_run = 0;
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 
   switch (Action)
@@ -350,6 +359,12 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci,
 
   Log1 (PCSC_LOG_INFO, "IFDHTransmitToICC");
 
+  if (LunInvalid (Lun))
+    {
+      *RxLength = 0;
+      return IFD_COMMUNICATION_ERROR;
+    }
+
   Log2 (PCSC_LOG_INFO, "Transmit Len = %" PRIu64, TxLength);
   Log2 (PCSC_LOG_INFO, "Receive Len = %" PRIu64, *RxLength);
   Log2 (PCSC_LOG_INFO, "negotiated protocol = %" PRIu8, proto);
@@ -370,9 +385,6 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci,
   *RxLength = 0;
   ptr_r = RxBuffer;
 
-  if (Lun)
-    return IFD_COMMUNICATION_ERROR;
-
   protocol = SendPci.Protocol;
   if (protocol > 1)
     return IFD_PROTOCOL_NOT_SUPPORTED;
@@ -735,7 +747,7 @@ IFDHControl (DWORD Lun, DWORD ControlCode,
 RESPONSECODE
 IFDHICCPresence (DWORD Lun)
 {
-  if (Lun)
+  if (LunInvalid (Lun))
     return IFD_COMMUNICATION_ERROR;
 // card is  always present ..
   return IFD_ICC_PRESENT;
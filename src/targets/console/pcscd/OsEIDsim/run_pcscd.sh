@@ -22,21 +22,34 @@
 #    connect pcscd daemon to simulavr with OsEID card (generic simualtion,
 #    not in simulavr)
 #
+#    Number of simulated cards (readers) can be set by env variable
+#    OsEID_CARDS (default 1), every card uses own working directory (own
+#    card_mem file), first card in current directory, next cards in
+#    tmp/card2, tmp/card3 ..
+#
 
 OsEID_DIR=`pwd`
 mkdir -p "${OsEID_DIR}/tmp"
-touch "${OsEID_DIR}/tmp/OsEIDsim.socket"
-DEV=$1
-if [ $? -lt 1 ]; then
-	socat -d -d pty,link=${OsEID_DIR}/tmp/OsEIDsim.socket,raw,echo=0 "exec:${OsEID_DIR}/build/console/console ...,pty,raw,echo=0" &
-	DEV="${OsEID_DIR}/tmp/OsEIDsim.socket"
-fi
+rm -f "${OsEID_DIR}/tmp/reader.conf"
+CARDS=${OsEID_CARDS:-1}
+for (( i=1; i<=${CARDS}; i++ )); do
+	if [ $i -eq 1 ]; then
+		SOCKET="${OsEID_DIR}/tmp/OsEIDsim.socket"
+		CARD_DIR="${OsEID_DIR}"
+	else
+		SOCKET="${OsEID_DIR}/tmp/OsEIDsim${i}.socket"
+		CARD_DIR="${OsEID_DIR}/tmp/card${i}"
+		mkdir -p "${CARD_DIR}"
+	fi
+	touch "${SOCKET}"
+	socat -d -d pty,link=${SOCKET},raw,echo=0 "exec:${OsEID_DIR}/build/console/console ...,pty,raw,echo=0,chdir=${CARD_DIR}" &
+	echo 'FRIENDLYNAME      "OsEIDsim"' >> "${OsEID_DIR}/tmp/reader.conf"
+	echo 'DEVICENAME        '${SOCKET} >> "${OsEID_DIR}/tmp/reader.conf"
+	echo 'LIBPATH           '${OsEID_DIR}/build/console/libOsEIDsim.so.0.0.1  >> "${OsEID_DIR}/tmp/reader.conf"
+	echo 'CHANNELID         '$i >>  "${OsEID_DIR}/tmp/reader.conf"
+	echo >> "${OsEID_DIR}/tmp/reader.conf"
+done
 sleep 1
-echo 'FRIENDLYNAME      "OsEIDsim"' > "${OsEID_DIR}/tmp/reader.conf"
-echo 'DEVICENAME        '$DEV >> "${OsEID_DIR}/tmp/reader.conf"
-echo 'LIBPATH           '${OsEID_DIR}/build/console/libOsEIDsim.so.0.0.1  >> "${OsEID_DIR}/tmp/reader.conf"
-echo 'CHANNELID         1' >>  "${OsEID_DIR}/tmp/reader.conf"
-
 
 debug=0
 
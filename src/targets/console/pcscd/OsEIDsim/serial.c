@@ -49,14 +49,17 @@ int hex2bytes (char *from, int size, uint8_t * to);
 
 
 
-static int reader_fd = -1;
-static char *reader_device;
+// one serial line (one simulator instance) per reader
+static int reader_fd[OsEIDsim_MAX_READERS] = {
+  [0 ... OsEIDsim_MAX_READERS - 1] = -1
+};
+static char *reader_device[OsEIDsim_MAX_READERS];
 
 static void
-FlushPort (void)
+FlushPort (int r)
 {
   fd_set fdset;
-  int fd = reader_fd;
+  int fd = reader_fd[r];
   struct timeval t;
   uint8_t byte;
   int i;
@@ -92,18 +95,19 @@ FlushPort (void)
 RESPONSECODE
 WritePort (DWORD lun, DWORD length, PUCHAR buffer)
 {
+  int r = LunToReader (lun);
   int rv;
 
-  if (reader_fd < 0)
+  if (reader_fd[r] < 0)
     {
       Log1 (PCSC_LOG_DEBUG, "WritePort skipped (no open port)\n");
       return RET_FAIL;
     }
 
-  FlushPort ();
+  FlushPort (r);
 
   log_xxd (PCSC_LOG_INFO, "OsEIDsim: transmit to card: ", buffer, length);
-  rv = write (reader_fd, buffer, length);
+  rv = write (reader_fd[r], buffer, length);
   if (rv < 0)
     {
       Log2 (PCSC_LOG_CRITICAL, "write error: %s", strerror (errno));
@@ -125,10 +129,11 @@ ReadPort (DWORD lun, PDWORD length, PUCHAR buffer)
   int max_resp_size = *length;
 
   fd_set fdset;
-  int fd = reader_fd;
+  int r = LunToReader (lun);
+  int fd = reader_fd[r];
   struct timeval t;
 
-  if (reader_fd < 0)
+  if (reader_fd[r] < 0)
     {
       Log1 (PCSC_LOG_DEBUG, "ReadPort skipped (no open port)\n");
       return RET_FAIL;
@@ -210,36 +215,37 @@ ReadPort (DWORD lun, PDWORD length, PUCHAR buffer)
 RESPONSECODE
 OpenGBP (DWORD lun, LPSTR dev_name)
 {
+  int r = LunToReader (lun);
   struct termios sparam;
 
-  if (reader_fd != -1)
+  if (reader_fd[r] != -1)
     {
       Log1 (PCSC_LOG_DEBUG, "OpenGBP skipped (open already opened)\n");
       return RET_FAIL;
     }
 
-  reader_fd = open (dev_name, O_RDWR | O_NOCTTY);
-  if (reader_fd < 0)
+  reader_fd[r] = open (dev_name, O_RDWR | O_NOCTTY);
+  if (reader_fd[r] < 0)
     {
       Log3 (PCSC_LOG_CRITICAL, "open %s: %s", dev_name, strerror (errno));
       // return value from "open" is always -1 on error,
       // but force this value into reader_fd to make coverity scan happy
-      reader_fd = -1;
+      reader_fd[r] = -1;
       return RET_FAIL;
     }
 
-  reader_device = strdup (dev_name);
+  reader_device[r] = strdup (dev_name);
 
-  if (tcflush (reader_fd, TCIOFLUSH))
+  if (tcflush (reader_fd[r], TCIOFLUSH))
     Log2 (PCSC_LOG_INFO, "tcflush() function error: %s", strerror (errno));
 
   // get config attributes */
-  if (tcgetattr (reader_fd, &sparam) == -1)
+  if (tcgetattr (reader_fd[r], &sparam) == -1)
     {
       Log2 (PCSC_LOG_INFO, "tcgetattr() function error: %s",
 	    strerror (errno));
-      close (reader_fd);
-      reader_fd = -1;
+      close (reader_fd[r]);
+      reader_fd[r] = -1;
       return RET_FAIL;
     }
 
@@ -337,12 +343,12 @@ OpenGBP (DWORD lun, LPSTR dev_name)
 
 
   //change immediately all parameters
-  if (tcsetattr (reader_fd, TCSANOW, &sparam))
+  if (tcsetattr (reader_fd[r], TCSANOW, &sparam))
     {
       Log2 (PCSC_LOG_INFO, "tcsetattr() function error: %s",
 	    strerror (errno));
-      close (reader_fd);
-      reader_fd = -1;
+      close (reader_fd[r]);
+      reader_fd[r] = -1;
       return RET_FAIL;
     }
   //alternate call ioctl(sparam.fd, TCSETS, &sparam)
@@ -355,16 +361,18 @@ OpenGBP (DWORD lun, LPSTR dev_name)
 RESPONSECODE
 CloseGBP (DWORD lun)
 {
-  if (reader_fd < 0)
+  int r = LunToReader (lun);
+
+  if (reader_fd[r] < 0)
     {
       Log1 (PCSC_LOG_DEBUG, "CloseGBP skipped (no open port)\n");
       return RET_FAIL;
     }
 
-  close (reader_fd);
-  reader_fd = -1;
-  free (reader_device);
-  reader_device = NULL;
+  close (reader_fd[r]);
+  reader_fd[r] = -1;
+  free (reader_device[r]);
+  reader_device[r] = NULL;
   return RET_OK;
 }
 
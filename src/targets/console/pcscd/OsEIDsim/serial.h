@@ -22,6 +22,12 @@
 
 */
 
+// pcscd Lun is 0xXXXXYYYY, XXXX = reader index, YYYY = slot index, one
+// slot per reader, each reader is connected to own simulator instance
+#define OsEIDsim_MAX_READERS 16
+#define LunToReader(lun) ((int)(((lun) >> 16) & 0xffff))
+#define LunInvalid(lun) (((lun) & 0xffff) || LunToReader (lun) >= OsEIDsim_MAX_READERS)
+
 #define RET_OK 0
 #define RET_FAIL 1
 RESPONSECODE OpenGBP (DWORD lun, LPSTR dev_name);
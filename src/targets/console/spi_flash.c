@@ -0,0 +1,210 @@
+/*
+    spi_flash.c
+
+    This is part of OsEID (Open source Electronic ID)
+
+    Copyright (C) 2015-2023 Peter Popovec, popovec.peter@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    SPI NOR flash model (25xx series) for console build, flash content
+    is stored in file "card_flash"
+
+    Model checks:
+    - page program can only clear bits, address wraps inside page
+    - write enable latch is needed for program/erase and cleared after
+    - commands without chip select, unknown commands
+
+    Power fail test: SPI_FLASH_POWER_FAIL=n in environment, the model
+    exits (card removed) after n-th sector erase.
+
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "spi_flash.h"
+
+//#define  DPRINT(msg...) fprintf(stderr,msg)
+#define DPRINT(msg...)
+
+// 1Mbit device + spare sector .. use 2Mbit
+#define FLASH_SIZE 0x40000UL
+
+static uint8_t flash[FLASH_SIZE];
+static uint8_t selected;
+static uint8_t status;
+static uint8_t cmd;
+static uint8_t changed;
+static uint16_t cycle;
+static uint32_t address;
+static unsigned long power_fail;
+
+// statistics
+static unsigned long stat_read, stat_program, stat_erase;
+
+static void spi_flash_fatal(const char *msg)
+{
+	fprintf(stderr, "SPI flash model: %s\n", msg);
+	exit(1);
+}
+
+static void spi_flash_writeback(void)
+{
+	int f;
+
+	f = open("card_flash", O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR);
+	if (f < 0)
+		spi_flash_fatal("unable to write card_flash");
+	if (write(f, flash, FLASH_SIZE) != FLASH_SIZE)
+		spi_flash_fatal("unable to write card_flash");
+	close(f);
+}
+
+void spi_flash_init(void)
+{
+	int f;
+	char *env;
+
+	env = getenv("SPI_FLASH_POWER_FAIL");
+	if (env)
+		power_fail = strtoul(env, NULL, 0);
+
+	memset(flash, 0xff, FLASH_SIZE);
+	f = open("card_flash", O_RDONLY);
+	if (f >= 0) {
+		if (read(f, flash, FLASH_SIZE) != FLASH_SIZE)
+			spi_flash_fatal("card_flash wrong size");
+		close(f);
+	}
+	// after power on, device is write protected
+	status = 0x1c;
+	selected = 0;
+}
+
+void spi_flash_select(void)
+{
+	if (selected)
+		spi_flash_fatal("select, device already selected");
+	selected = 1;
+	cycle = 0;
+}
+
+void spi_flash_deselect(void)
+{
+	if (!selected)
+		spi_flash_fatal("deselect, device not selected");
+	selected = 0;
+	if (cmd == SPI_FLASH_CMD_PP || cmd == SPI_FLASH_CMD_SE || cmd == SPI_FLASH_CMD_WRSR)
+		status &= ~SPI_FLASH_SR_WEL;
+	if (changed)
+		spi_flash_writeback();
+	changed = 0;
+	cmd = 0;
+}
+
+uint8_t spi_flash_xfer(uint8_t data)
+{
+	uint8_t ret = 0xff;
+
+	if (!selected)
+		spi_flash_fatal("transfer without chip select");
+
+	if (cycle == 0) {
+		cmd = data;
+		switch (cmd) {
+		case SPI_FLASH_CMD_WREN:
+			status |= SPI_FLASH_SR_WEL;
+			break;
+		case SPI_FLASH_CMD_READ:
+			stat_read++;
+			break;
+		case SPI_FLASH_CMD_PP:
+		case SPI_FLASH_CMD_SE:
+		case SPI_FLASH_CMD_WRSR:
+			if (!(status & SPI_FLASH_SR_WEL))
+				spi_flash_fatal("program/erase without write enable");
+			break;
+		case SPI_FLASH_CMD_RDSR:
+		case SPI_FLASH_CMD_RDID:
+			break;
+		default:
+			spi_flash_fatal("unknown command");
+		}
+		cycle++;
+		return ret;
+	}
+
+	switch (cmd) {
+	case SPI_FLASH_CMD_RDSR:
+		ret = status;
+		break;
+	case SPI_FLASH_CMD_RDID:
+		// 0xEF Winbond, W25X20
+		ret = cycle == 1 ? 0xef : cycle == 2 ? 0x30 : 0x12;
+		break;
+	case SPI_FLASH_CMD_WRSR:
+		if (cycle == 1)
+			status = (status & 3) | (data & 0xfc);
+		break;
+	case SPI_FLASH_CMD_READ:
+	case SPI_FLASH_CMD_PP:
+	case SPI_FLASH_CMD_SE:
+		if (cycle < 4) {
+			address = (address << 8) | data;
+			if (cycle == 3) {
+				address &= FLASH_SIZE - 1;
+				if (cmd == SPI_FLASH_CMD_SE) {
+					if (status & 0x1c)
+						spi_flash_fatal("erase, device is protected");
+					address &= ~(uint32_t) (SPI_FLASH_SECTOR - 1);
+					memset(flash + address, 0xff, SPI_FLASH_SECTOR);
+					stat_erase++;
+					changed = 1;
+					if (power_fail && !--power_fail) {
+						spi_flash_writeback();
+						spi_flash_fatal("power fail");
+					}
+				}
+				if (cmd == SPI_FLASH_CMD_PP)
+					stat_program++;
+			}
+			break;
+		}
+		if (cmd == SPI_FLASH_CMD_READ) {
+			ret = flash[address];
+			address = (address + 1) & (FLASH_SIZE - 1);
+		} else if (cmd == SPI_FLASH_CMD_PP) {
+			if (status & 0x1c)
+				spi_flash_fatal("program, device is protected");
+			flash[address] &= data;
+			address = (address & ~(uint32_t) (SPI_FLASH_PAGE - 1)) |
+			    ((address + 1) & (SPI_FLASH_PAGE - 1));
+			changed = 1;
+		}
+		break;
+	}
+	if (cycle < 0xffff)
+		cycle++;
+	// statistics (DPRINT may be empty)
+	if (cycle == 4 && cmd == SPI_FLASH_CMD_SE) {
+		DPRINT("SPI flash statistics: read %lu program %lu erase %lu\n",
+		       stat_read, stat_program, stat_erase);
+	}
+	return ret;
+}